@@ -0,0 +1,184 @@
+/* Cants benchmarks.
+ * Generates a large map and compares loading it raw and run-length encoded,
+ * then the tile scan kernels against plain loops, the leaf distance field updates and picking spots for new leaves.
+ * Usage: cants-bench [width height]
+ * The files are loaded from the page cache, so this measures decoding and copying,
+ * the time to read them from cold storage scales with the file sizes printed.
+ */
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "map.h"
+#include "scan.h"
+#include "field.h"
+
+#define BENCH_RAW_PATH "bench-raw.bin"
+#define BENCH_RLE_PATH "bench-rle.bin"
+#define BENCH_RUNS 5
+
+//walled border, rectangular wall blocks and scattered leaves, roughly like the real maps
+void generate_map(int width, int height) {
+    g_map.anthill_x = g_map.anthill_y = -1;
+    if (!map_alloc(&g_map, width, height)) {
+        fprintf(stderr, "Could not allocate %dx%d map\n", width, height);
+        exit(1);
+    }
+    srand(1);
+    for (int i = 0; i < height; i++) {
+        map_set(&g_map, 0, i, MAP_WALL);
+        map_set(&g_map, width - 1, i, MAP_WALL);
+    }
+    for (int j = 0; j < width; j++) {
+        map_set(&g_map, j, 0, MAP_WALL);
+        map_set(&g_map, j, height - 1, MAP_WALL);
+    }
+    long blocks = (long) width * height / 400;
+    for (long k = 0; k < blocks; k++) {
+        int x = rand() % width, y = rand() % height;
+        int w = rand() % 12 + 1, h = rand() % 12 + 1;
+        for (int i = y; i < y + h && i < height; i++)
+            for (int j = x; j < x + w && j < width; j++)
+                map_set(&g_map, j, i, MAP_WALL);
+    }
+    long leaves = (long) width * height / 90;
+    for (long k = 0; k < leaves; k++) {
+        map_set(&g_map, rand() % width, rand() % height, MAP_FOOD);
+    }
+}
+
+long file_size(char *path) {
+    SDL_RWops *file = SDL_RWFromFile(path, "rb");
+    if (file == NULL) return -1;
+    long size = SDL_RWsize(file);
+    SDL_RWclose(file);
+    return size;
+}
+
+//best time of BENCH_RUNS loads in milliseconds
+double bench_load(char *path, enum MAP_LOAD how) {
+    double best = -1;
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        if (!load_map_mode(path, how)) {
+            fprintf(stderr, "Could not load %s\n", path);
+            exit(1);
+        }
+        double ms = (double) (SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency();
+        destroy_map(&g_map);
+        if (best < 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+double seconds_since(Uint64 start) {
+    return (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+//best throughput of BENCH_RUNS passes over the whole map in GB/s, result keeps the work from being optimised out
+#define BENCH_SCAN(name, expr) do { \
+    double best = 0; \
+    size_t result = 0; \
+    for (int run = 0; run < BENCH_RUNS; run++) { \
+        Uint64 start = SDL_GetPerformanceCounter(); \
+        result += (expr); \
+        double gbs = (double) tiles_num / seconds_since(start) / 1e9; \
+        if (gbs > best) best = gbs; \
+    } \
+    printf("%-20s %12.2f %12zu\n", name, best, result / BENCH_RUNS); \
+} while (0)
+
+size_t histogram_scalar(const int8_t *tiles, size_t tiles_num) {
+    size_t counts[MAP_TOTAL] = {0};
+    return scan_histogram_scalar(tiles, tiles_num, counts) + counts[MAP_WALL];
+}
+
+size_t histogram_simd(const int8_t *tiles, size_t tiles_num) {
+    size_t counts[MAP_TOTAL] = {0};
+    return scan_histogram(tiles, tiles_num, counts) + counts[MAP_WALL];
+}
+
+void bench_scan(void) {
+    //the kernels run over one contiguous block, without the border between the rows
+    size_t tiles_num = (size_t) g_map.width * g_map.height;
+    int8_t *tiles = malloc(tiles_num);
+    if (tiles == NULL) exit(1);
+    for (int i = 0; i < g_map.height; i++)
+        memcpy(tiles + (size_t) i * g_map.width, map_row(&g_map, i), g_map.width);
+    //a lone anthill at the very end is the worst case for finding it
+    tiles[tiles_num - 1] = MAP_ANTHILL;
+    printf("%-20s %12s %12s\n", "scan", "GB/s", "result");
+    BENCH_SCAN("histogram scalar", histogram_scalar(tiles, tiles_num));
+    BENCH_SCAN("histogram simd", histogram_simd(tiles, tiles_num));
+    BENCH_SCAN("find anthill scalar", scan_find_first_scalar(tiles, tiles_num, MAP_ANTHILL));
+    BENCH_SCAN("find anthill simd", scan_find_first(tiles, tiles_num, MAP_ANTHILL));
+    BENCH_SCAN("count food scalar", scan_count_scalar(tiles, tiles_num, MAP_FOOD));
+    BENCH_SCAN("count food simd", scan_count(tiles, tiles_num, MAP_FOOD));
+    free(tiles);
+}
+
+#define BENCH_FIELD_UPDATES 1000
+
+//a full build against taking a leaf and putting it back, which is what the game does on every pickup
+void bench_field(void) {
+    if (!index_map(&g_map)) exit(1);
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (!build_field(&g_field, &g_map)) exit(1);
+    double build_ms = seconds_since(start) * 1000;
+    start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < BENCH_FIELD_UPDATES; i++) {
+        Point leaf;
+        do leaf = (Point) {rand() % g_map.width, rand() % g_map.height};
+        while (map_get(&g_map, leaf.x, leaf.y) != MAP_FOOD);
+        map_set(&g_map, leaf.x, leaf.y, MAP_FREE);
+        field_remove_food(&g_field, &g_map, leaf.x, leaf.y);
+        map_set(&g_map, leaf.x, leaf.y, MAP_FOOD);
+        field_add_food(&g_field, &g_map, leaf.x, leaf.y);
+    }
+    double update_us = seconds_since(start) * 1e6 / BENCH_FIELD_UPDATES;
+    printf("%-20s %12.2f ms\n%-20s %12.2f us\n", "field build", build_ms, "field take and put", update_us);
+    destroy_field(&g_field);
+}
+
+#define BENCH_SPAWNS 100000
+
+//leaves grow outside the camera, a screen of tiles somewhere on the map
+void bench_spawn(void) {
+    Rng rng = rng_stream(1, 0);
+    Uint64 start = SDL_GetPerformanceCounter();
+    size_t found = 0;
+    for (int i = 0; i < BENCH_SPAWNS; i++) {
+        int x = rng_below(&rng, g_map.width), y = rng_below(&rng, g_map.height);
+        found += find_random_free_spot_outside(&rng, x, y, x + 40, y + 22).x != -1;
+    }
+    printf("%-20s %12.2f us %12zu\n", "spawn outside", seconds_since(start) * 1e6 / BENCH_SPAWNS, found);
+}
+
+int main(int argc, char *argv[]) {
+    int width = 4096, height = 4096;
+    if (argc == 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+
+    generate_map(width, height);
+    if (!save_map(BENCH_RAW_PATH, MAP_ENCODING_RAW) || !save_map(BENCH_RLE_PATH, MAP_ENCODING_RLE))
+        exit(1);
+    bench_scan();
+    bench_field();
+    bench_spawn();
+    destroy_map(&g_map);
+    putchar('\n');
+
+    printf("map %dx%d, best of %d loads\n", width, height, BENCH_RUNS);
+    printf("%-8s %12s %12s %12s %12s\n", "encoding", "size", "copy ms", "mapped ms", "readonly ms");
+    printf("%-8s %12ld %12.2f %12.2f %12.2f\n", "raw", file_size(BENCH_RAW_PATH),
+            bench_load(BENCH_RAW_PATH, MAP_LOAD_COPY), bench_load(BENCH_RAW_PATH, MAP_LOAD_MAPPED_COPY), bench_load(BENCH_RAW_PATH, MAP_LOAD_READONLY));
+    printf("%-8s %12ld %12.2f %12.2f %12.2f\n", "rle", file_size(BENCH_RLE_PATH),
+            bench_load(BENCH_RLE_PATH, MAP_LOAD_COPY), bench_load(BENCH_RLE_PATH, MAP_LOAD_MAPPED_COPY), bench_load(BENCH_RLE_PATH, MAP_LOAD_READONLY));
+
+    remove(BENCH_RAW_PATH);
+    remove(BENCH_RLE_PATH);
+    return 0;
+}
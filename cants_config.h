@@ -14,4 +14,13 @@
 #define TUTORIAL 1
 #endif
 
+//load maps with mmap where possible (falls back to reading the file)
+#ifndef MMAP_MAPS
+#ifdef _WIN32
+#define MMAP_MAPS 0
+#else
+#define MMAP_MAPS 1
+#endif
+#endif
+
 #endif
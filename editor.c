@@ -1,8 +1,18 @@
 /* Cants map editor.
  * A cants map is a binary format that consists of:
- * a byte for height (uint8)
- * a byte for width (uint8)
- * binary data of the map (width * height bytes, because a single tile is an int8_t)
+ * the "CANTS_MAP" signature
+ * a zero byte (version 1 maps had a width byte here instead, see below)
+ * a byte for the format version (uint8, currently 2)
+ * a byte for the tile encoding (uint8, 0 is raw, 1 is run-length encoded) and a reserved byte
+ * width, height (uint32 little endian)
+ * x and y of the top left anthill tile (int32 little endian, -1 if there is no anthill)
+ * Adler-32 checksum of the tiles and the size of the tile data in bytes (uint32 little endian)
+ * zero padding up to 40 bytes
+ * binary data of the map (width * height bytes row by row, because a single tile is an int8_t)
+ * or, if run-length encoded, runs of a tile byte followed by the run length as a LEB128 varint
+ *
+ * Version 1 maps (still loaded, never written) have a byte for width and a byte for height
+ * right after the signature, followed by the tiles.
  */
 
 #include <SDL2/SDL.h>
@@ -10,7 +20,7 @@
 #include <SDL2/SDL_ttf.h>
 #include <stdio.h>
 #include "map.h"
-#include <errno.h>
+#include "scan.h"
 #include <ctype.h>
 #include <string.h>
 
@@ -48,6 +58,9 @@ int level_height;
 
 int cur_mode = -1;
 
+//maps are written run-length encoded unless converted with the encode command
+enum MAP_ENCODING save_encoding = MAP_ENCODING_RLE;
+
 #define INIT_CELL_SIZE 25
 int CELL_SIZE = INIT_CELL_SIZE;
 
@@ -192,66 +205,39 @@ bool check_collision(SDL_Rect a, SDL_Rect b) {
 }
 
 bool write_map_to_file(char *path) {
-    SDL_RWops* map_file = SDL_RWFromFile(path, "wb");
-    if (map_file == NULL) {
-        fprintf(stderr, "Failed to open %s for writing: %s\n", path, strerror(errno));
-        return false;
-    }
-
-
-    char signature[] = CANTS_MAP_SIGNATURE;
-    SDL_RWwrite(map_file, &signature, sizeof(char), sizeof(signature) - 1 * sizeof(char));
-    
-    SDL_RWwrite(map_file, &g_map.width,  sizeof g_map.width, 1);
-    SDL_RWwrite(map_file, &g_map.height, sizeof g_map.height, 1);
-
-    int8_t buf[9];
+    int8_t buf[3][3];
     int gm_x = 0, gm_y = 0;
 
     if (g_anthill.x != -1) {
         gm_x = g_anthill.x / CELL_SIZE;
         gm_y = g_anthill.y / CELL_SIZE;
-        buf[0] = g_map.matrix[gm_y + 0][gm_x + 0];
-        buf[1] = g_map.matrix[gm_y + 1][gm_x + 0];
-        buf[2] = g_map.matrix[gm_y + 2][gm_x + 0];
-        buf[3] = g_map.matrix[gm_y + 0][gm_x + 1];
-        buf[4] = g_map.matrix[gm_y + 1][gm_x + 1];
-        buf[5] = g_map.matrix[gm_y + 2][gm_x + 1];
-        buf[6] = g_map.matrix[gm_y + 0][gm_x + 2];
-        buf[7] = g_map.matrix[gm_y + 1][gm_x + 2];
-        buf[8] = g_map.matrix[gm_y + 2][gm_x + 2];
-        g_map.matrix[gm_y + 0][gm_x + 0] = MAP_ANTHILL;
-        g_map.matrix[gm_y + 1][gm_x + 0] = MAP_ANTHILL;
-        g_map.matrix[gm_y + 2][gm_x + 0] = MAP_ANTHILL;
-        g_map.matrix[gm_y + 0][gm_x + 1] = MAP_ANTHILL;
-        g_map.matrix[gm_y + 1][gm_x + 1] = MAP_ANTHILL;
-        g_map.matrix[gm_y + 2][gm_x + 1] = MAP_ANTHILL;
-        g_map.matrix[gm_y + 0][gm_x + 2] = MAP_ANTHILL;
-        g_map.matrix[gm_y + 1][gm_x + 2] = MAP_ANTHILL;
-        g_map.matrix[gm_y + 2][gm_x + 2] = MAP_ANTHILL;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) {
+                buf[i][j] = map_get(&g_map, gm_x + j, gm_y + i);
+                map_set(&g_map, gm_x + j, gm_y + i, MAP_ANTHILL);
+            }
+        g_map.anthill_x = gm_x;
+        g_map.anthill_y = gm_y;
     }
-
-    for (int i = 0; i < g_map.height; i++) {
-        SDL_RWwrite(map_file, g_map.matrix[i], sizeof(int8_t), g_map.width);
+    else {
+        //not opened for editing, the anthill (if any) is still in the tiles, its first tile is the top left one
+        Point anthill = map_find_first(&g_map, MAP_ANTHILL);
+        g_map.anthill_x = anthill.x;
+        g_map.anthill_y = anthill.y;
     }
-    SDL_RWclose(map_file);
+
+    bool written = save_map(path, save_encoding);
 
     if (g_anthill.x != -1) {
-        g_map.matrix[gm_y + 0][gm_x + 0] = buf[0];
-        g_map.matrix[gm_y + 1][gm_x + 0] = buf[1];
-        g_map.matrix[gm_y + 2][gm_x + 0] = buf[2];
-        g_map.matrix[gm_y + 0][gm_x + 1] = buf[3];
-        g_map.matrix[gm_y + 1][gm_x + 1] = buf[4];
-        g_map.matrix[gm_y + 2][gm_x + 1] = buf[5];
-        g_map.matrix[gm_y + 0][gm_x + 2] = buf[6];
-        g_map.matrix[gm_y + 1][gm_x + 2] = buf[7];
-        g_map.matrix[gm_y + 2][gm_x + 2] = buf[8];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                map_set(&g_map, gm_x + j, gm_y + i, buf[i][j]);
     }
-    return true;
+    return written;
 }
 
 void usage(void) {
-    printf("Usage: editor <file> | create <filename> <width> <height> | info <file> | translate <file> <x> <y> | resize <file> <dx> <dy>\nSee README for details\n");
+    printf("Usage: editor <file> | create <filename> <width> <height> | info <file> [<x> <y> <w> <h>] | translate <file> <x> <y> | resize <file> <dx> <dy> | encode <file> <raw|rle>\nSee README for details\n");
     exit(0);
 }
 
@@ -260,35 +246,44 @@ void translate(int x, int y) {
         g_anthill.x += x * CELL_SIZE;
         g_anthill.y -= y * CELL_SIZE;
     }
+    //rows are evenly spaced, so a vertical translation rotates the whole block by y rows,
+    //the border columns move along with them and stay walls
+    size_t row_size = g_map.stride * sizeof(int8_t);
     if (y > 0) {
-        int8_t *buf[y];
-        memcpy(buf, g_map.matrix, y * sizeof(int8_t *));
-        memmove(g_map.matrix, g_map.matrix + y, (g_map.height - y) * sizeof(int8_t *));
-        memcpy(g_map.matrix + g_map.height - y, buf, y * sizeof(int8_t *));
+        int8_t *buf = malloc(y * row_size);
+        memcpy(buf, map_row(&g_map, 0), y * row_size);
+        memmove(map_row(&g_map, 0), map_row(&g_map, y), (g_map.height - y) * row_size);
+        memcpy(map_row(&g_map, g_map.height - y), buf, y * row_size);
+        free(buf);
     }
     else if (y < 0) {
         y = -y;
-        int8_t *buf[y];
-        memcpy(buf, g_map.matrix + g_map.height - y, y * sizeof(int8_t *));
-        memmove(g_map.matrix + y, g_map.matrix, (g_map.height - y) * sizeof(int8_t *));
-        memcpy(g_map.matrix, buf, y * sizeof(int8_t *));
+        int8_t *buf = malloc(y * row_size);
+        memcpy(buf, map_row(&g_map, g_map.height - y), y * row_size);
+        memmove(map_row(&g_map, y), map_row(&g_map, 0), (g_map.height - y) * row_size);
+        memcpy(map_row(&g_map, 0), buf, y * row_size);
+        free(buf);
     }
     if (x > 0)
         for (int i = 0; i < g_map.height; i++) {
             int8_t buf[x];
-            memcpy(buf, g_map.matrix[i] + g_map.width - x, x * sizeof(int8_t));
-            memmove(g_map.matrix[i] + x, g_map.matrix[i], (g_map.width - x) * sizeof(int8_t));
-            memcpy(g_map.matrix[i], buf, x * sizeof(int8_t));
+            int8_t *row = map_row(&g_map, i);
+            memcpy(buf, row + g_map.width - x, x * sizeof(int8_t));
+            memmove(row + x, row, (g_map.width - x) * sizeof(int8_t));
+            memcpy(row, buf, x * sizeof(int8_t));
         }
     else if (x < 0) {
         x = -x;
         for (int i = 0; i < g_map.height; i++) {
             int8_t buf[x];
-            memcpy(buf, g_map.matrix[i], x * sizeof(int8_t));
-            memmove(g_map.matrix[i], g_map.matrix[i] + x, (g_map.width - x) * sizeof(int8_t));
-            memcpy(g_map.matrix[i] + g_map.width - x, buf, x * sizeof(int8_t));
+            int8_t *row = map_row(&g_map, i);
+            memcpy(buf, row, x * sizeof(int8_t));
+            memmove(row, row + x, (g_map.width - x) * sizeof(int8_t));
+            memcpy(row + g_map.width - x, buf, x * sizeof(int8_t));
         }
     }
+    //every tile may have moved
+    index_map(&g_map);
 }
 
 
@@ -313,38 +308,21 @@ void edit(char *map_path) {
     float world_scale = 1;
 
     //check if the anthill is present on the map
-    for (int i = 0; i < g_map.height; i++) {
-        for (int j = 0; j < g_map.width; j++) {
-            if (g_map.matrix[i][j] == MAP_ANTHILL) {
-                if (g_map.matrix[i + 1][j + 0] == MAP_ANTHILL &&
-                    g_map.matrix[i + 2][j + 0] == MAP_ANTHILL &&
-                    g_map.matrix[i + 0][j + 1] == MAP_ANTHILL &&
-                    g_map.matrix[i + 1][j + 1] == MAP_ANTHILL &&
-                    g_map.matrix[i + 2][j + 1] == MAP_ANTHILL &&
-                    g_map.matrix[i + 0][j + 2] == MAP_ANTHILL &&
-                    g_map.matrix[i + 1][j + 2] == MAP_ANTHILL &&
-                    g_map.matrix[i + 2][j + 2] == MAP_ANTHILL) {
-                        g_anthill.y = i * CELL_SIZE;
-                        g_anthill.x = j * CELL_SIZE;
-                        g_map.matrix[i + 0][j + 0] = MAP_FREE;
-                        g_map.matrix[i + 1][j + 0] = MAP_FREE;
-                        g_map.matrix[i + 2][j + 0] = MAP_FREE;
-                        g_map.matrix[i + 0][j + 1] = MAP_FREE;
-                        g_map.matrix[i + 1][j + 1] = MAP_FREE;
-                        g_map.matrix[i + 2][j + 1] = MAP_FREE;
-                        g_map.matrix[i + 0][j + 2] = MAP_FREE;
-                        g_map.matrix[i + 1][j + 2] = MAP_FREE;
-                        g_map.matrix[i + 2][j + 2] = MAP_FREE;
-                        goto out;
-            }
-                else {
-                    fprintf(stderr, "Error: Something is wrong with the anthill in the map.\n");
-                    exit(1);
-                }
-            }
+    Point anthill = map_find_first(&g_map, MAP_ANTHILL);
+    if (anthill.x != -1) {
+        int i = anthill.y, j = anthill.x;
+        bool whole = j + 2 < g_map.width && i + 2 < g_map.height;
+        for (int k = 0; k < 9 && whole; k++)
+            whole = map_get(&g_map, j + k / 3, i + k % 3) == MAP_ANTHILL;
+        if (!whole) {
+            fprintf(stderr, "Error: Something is wrong with the anthill in the map.\n");
+            exit(1);
         }
+        g_anthill.y = i * CELL_SIZE;
+        g_anthill.x = j * CELL_SIZE;
+        for (int k = 0; k < 9; k++)
+            map_set(&g_map, j + k / 3, i + k % 3, MAP_FREE);
     }
-    out:;
 
     SDL_Event event;
     while (!quit) {
@@ -370,7 +348,7 @@ void edit(char *map_path) {
                                 }
                             }
                             else {
-                                g_map.matrix[y / CELL_SIZE][x / CELL_SIZE] = cur_mode;
+                                map_set(&g_map, x / CELL_SIZE, y / CELL_SIZE, cur_mode);
                             }
                         }
                             
@@ -379,7 +357,7 @@ void edit(char *map_path) {
                         rmb_pressed = true;
                         int x = event.button.x + g_camera.x, y = event.button.y + g_camera.y; 
                         if (x > 0 && x < level_width && y > 0 && y < level_height)
-                            g_map.matrix[y / CELL_SIZE][x / CELL_SIZE] = MAP_FREE;
+                            map_set(&g_map, x / CELL_SIZE, y / CELL_SIZE, MAP_FREE);
                     }
                     break;
                 case SDL_MOUSEBUTTONUP:
@@ -400,12 +378,12 @@ void edit(char *map_path) {
                     else if (lmb_pressed && cur_mode != MAP_ANTHILL) {
                         int x = event.motion.x + g_camera.x, y = event.motion.y + g_camera.y; 
                         if (x > 0 && x < level_width && y > 0 && y < level_height)
-                            g_map.matrix[y / CELL_SIZE][x / CELL_SIZE] = cur_mode;
+                            map_set(&g_map, x / CELL_SIZE, y / CELL_SIZE, cur_mode);
                     }
                     else if (rmb_pressed) {
                         int x = event.motion.x + g_camera.x, y = event.motion.y + g_camera.y; 
                         if (x > 0 && x < level_width && y > 0 && y < level_height)
-                            g_map.matrix[y / CELL_SIZE][x / CELL_SIZE] = MAP_FREE;
+                            map_set(&g_map, x / CELL_SIZE, y / CELL_SIZE, MAP_FREE);
                     }
                     break;
                 case SDL_KEYDOWN:
@@ -489,8 +467,9 @@ void edit(char *map_path) {
 
         SDL_SetRenderDrawColor(g_renderer, 0x00, 0x90, 0x00, 0xFF);
         for (int i = 0; i < min((g_camera.y + g_camera.h + CELL_SIZE) / CELL_SIZE, g_map.height); i++) {
+            int8_t *row = map_row(&g_map, i);
             for (int j = 0; j < min((g_camera.x + g_camera.w + CELL_SIZE) / CELL_SIZE, g_map.width); j++) {
-                if (g_map.matrix[i][j] == MAP_WALL) {
+                if (row[j] == MAP_WALL) {
                     SDL_Rect coords = {
                         j * CELL_SIZE - g_camera.x,
                         i * CELL_SIZE - g_camera.y,
@@ -499,10 +478,10 @@ void edit(char *map_path) {
                     };
                     SDL_RenderFillRect(g_renderer, &coords);
                 }
-                else if (g_map.matrix[i][j] == MAP_FOOD) {
+                else if (row[j] == MAP_FOOD) {
                     render_texture(g_leaf_texture, j * CELL_SIZE - g_camera.x, i * CELL_SIZE - g_camera.y, (float) CELL_SIZE / g_leaf_texture.width * world_scale);
                 }
-                else if (g_map.matrix[i][j] == MAP_ENCLOSED) {
+                else if (row[j] == MAP_ENCLOSED) {
                     SDL_Rect coords = {
                         j * CELL_SIZE - g_camera.x,
                         i * CELL_SIZE - g_camera.y,
@@ -516,7 +495,7 @@ void edit(char *map_path) {
                     SDL_SetRenderDrawColor(g_renderer, 0x00, 0x90, 0x00, 0xFF);
 #endif
                 }
-                else if (g_map.matrix[i][j] == MAP_ANTHILL) {
+                else if (row[j] == MAP_ANTHILL) {
                     SDL_Rect coords = {
                         j * CELL_SIZE - g_camera.x,
                         i * CELL_SIZE - g_camera.y,
@@ -549,13 +528,19 @@ void edit(char *map_path) {
     SDL_Quit();
 }
 
-int *get_map_info() {
+size_t *get_map_info() {
+
+    size_t *tile_counts = malloc(MAP_TOTAL * sizeof(size_t));
+    map_histogram(&g_map, tile_counts);
+    return tile_counts;
+}
+
+//tile counts of the part of the map inside the rectangle (e.g. how many leaves an area has)
+size_t *get_rect_info(int x, int y, int w, int h) {
 
-    int *tile_counts = malloc(MAP_TOTAL * sizeof(int));
-    memset(tile_counts, 0, MAP_TOTAL * sizeof(int));
-    for (int i = 0; i < g_map.height; i++)
-        for (int j = 0; j < g_map.width; j++)
-            tile_counts[g_map.matrix[i][j]]++;
+    size_t *tile_counts = malloc(MAP_TOTAL * sizeof(size_t));
+    for (int i = 0; i < MAP_TOTAL; i++)
+        tile_counts[i] = map_count_in_rect(&g_map, x, y, w, h, i);
     return tile_counts;
 }
 
@@ -567,56 +552,50 @@ bool isnumber(char *str) {
     return true;
 }
 
-bool create_map(char *name, int width, int height) {
-    if (width > 255 || height > 255) {
-        fprintf(stderr, "Width and height greater than 255 are not supported\n");
+bool create_map(char *name, long width, long height) {
+    if (width > MAP_MAX_SIDE || height > MAP_MAX_SIDE || (uint64_t) width * height > MAP_MAX_TILES) {
+        fprintf(stderr, "Width and height greater than %d or more than %u tiles are not supported\n", MAP_MAX_SIDE, MAP_MAX_TILES);
         return false;
     }
-    int8_t *map[height];
-    int8_t zeros[width];
-    memset(zeros, 0, width * sizeof(int8_t));
-
-    for (int i = 0; i < height; i++) {
-        //get a pointer to the first element
-        map[i] = &zeros[0];
+    if (!map_alloc(&g_map, width, height)) {
+        fprintf(stderr, "calloc failed\n");
+        return false;
     }
-    g_map.matrix = map;
-    g_map.width = width;
-    g_map.height = height;
-    return write_map_to_file(name);
+    g_map.anthill_x = g_map.anthill_y = -1;
+    bool written = write_map_to_file(name);
+    destroy_map(&g_map);
+    return written;
 }
 
 bool resize(int dx, int dy) {
     int new_width = g_map.width + dx;
     int new_height = g_map.height + dy;
-    if (new_height < g_map.height) {
-        for (int i = new_height; i < g_map.height; i++) {
-            free(g_map.matrix[i]);
-        }
+    if (new_width <= 0 || new_height <= 0 || new_width > MAP_MAX_SIDE || new_height > MAP_MAX_SIDE ||
+            (uint64_t) new_width * new_height > MAP_MAX_TILES) {
+        fprintf(stderr, "New size %dx%d is not supported\n", new_width, new_height);
+        return false;
     }
-    for (int i = 0; i < ((new_height < g_map.height) ? new_height: g_map.height); i++) {
-        if ((g_map.matrix[i] = realloc(g_map.matrix[i], sizeof(int8_t) * new_width)) == NULL) {
-            fprintf(stderr, "realloc failed\n");
-            return false;
-        };
-        if (new_width > g_map.width) {
-            memset(g_map.matrix[i] + g_map.width, 0, dx);
-        }
+    //the resized map starts without an index, which is built again once the tiles are copied,
+    //so nothing of the old map's index is shared with it and freed twice
+    Map resized = {0};
+    resized.anthill_x = g_map.anthill_x;
+    resized.anthill_y = g_map.anthill_y;
+    if (!map_alloc(&resized, new_width, new_height)) {
+        fprintf(stderr, "calloc failed\n");
+        return false;
     }
-    if ((g_map.matrix = realloc(g_map.matrix, sizeof(int8_t *) * new_height)) == NULL) {
-            fprintf(stderr, "realloc failed\n");
-            return false;
+    //copy the overlapping part row by row, the rest stays free
+    int copy_width = min(new_width, g_map.width);
+    int copy_height = min(new_height, g_map.height);
+    for (int i = 0; i < copy_height; i++) {
+        memcpy(map_row(&resized, i), map_row(&g_map, i), copy_width * sizeof(int8_t));
     }
-    if (new_height > g_map.height) {
-        for (int i = g_map.height; i < new_height; i++) {
-            if ((g_map.matrix[i] = calloc(new_width, sizeof(int8_t))) == NULL) {
-                    fprintf(stderr, "malloc failed\n");
-                    return false;
-            }
-        }
+    destroy_map(&g_map);
+    g_map = resized;
+    if (!index_map(&g_map)) {
+        fprintf(stderr, "malloc failed\n");
+        return false;
     }
-    g_map.height = new_height;
-    g_map.width = new_width;
     return true;
 }
 
@@ -638,14 +617,23 @@ int main (int argc, char *argv[]) {
             usage();
         }
         else {
-            if (load_map(*argv)) {
+            //info only reads the tiles, so they are scanned straight from the page cache
+            if (load_map_mode(*argv, MAP_LOAD_READONLY)) {
                 printf("%s: %dx%d\n", *argv, g_map.width, g_map.height);
-                int *info = get_map_info();
+                size_t *info;
+                if (argv[1] != NULL && argv[2] != NULL && argv[3] != NULL && argv[4] != NULL) {
+                    int x = atoi(argv[1]), y = atoi(argv[2]), w = atoi(argv[3]), h = atoi(argv[4]);
+                    printf("%dx%d at %d %d\n", w, h, x, y);
+                    info = get_rect_info(x, y, w, h);
+                }
+                else
+                    info = get_map_info();
                 for (int i = 0; i < MAP_TOTAL; i++) {
                     if (info[i] > 0)
-                        printf("%s: %d\n", tile_to_string(i), info[i]);
+                        printf("%s: %zu\n", tile_to_string(i), info[i]);
                 }
                 free(info);
+                destroy_map(&g_map);
             }
         }
     }
@@ -656,7 +644,7 @@ int main (int argc, char *argv[]) {
             printf("Dimension provided is not a positive number\n");
             exit(1);
         }
-        int width = atoi(argv[1]), height = atoi(argv[2]);
+        long width = strtol(argv[1], NULL, 10), height = strtol(argv[2], NULL, 10);
         if (width == 0) {
             printf("Width cannot be 0!\n");
             exit(1);
@@ -665,8 +653,9 @@ int main (int argc, char *argv[]) {
             printf("Height cannot be 0!\n");
             exit(1);
         }
-        create_map(*argv, width, height);
-        printf("%dx%d map '%s' created successfully\n", width, height, *argv);
+        if (!create_map(*argv, width, height))
+            exit(1);
+        printf("%ldx%ld map '%s' created successfully\n", width, height, *argv);
         
     }
     else if (strcmp("resize", *argv) == 0) {
@@ -702,6 +691,23 @@ int main (int argc, char *argv[]) {
         }
         printf("Map '%s' translated by %d and %d successfully\n", *argv, x, y);
     }
+    else if (strcmp("encode", *argv) == 0) {
+        if (*++argv == NULL || argv[1] == NULL)
+            usage();
+        if (strcmp("raw", argv[1]) == 0)
+            save_encoding = MAP_ENCODING_RAW;
+        else if (strcmp("rle", argv[1]) != 0)
+            usage();
+        if (!load_map(*argv)) {
+            fprintf(stderr, "Could not load %s", *argv);
+            exit(1);
+        };
+        if (!write_map_to_file(*argv)) {
+            fprintf(stderr, "Could not write the map to file %s", *argv);
+            exit(1);
+        }
+        printf("Map '%s' saved as %s\n", *argv, argv[1]);
+    }
     else if(strcmp("help", *argv) == 0 || strcmp("-help", *argv) == 0 || strcmp("--help", *argv) == 0) {
         usage();
     }
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+#include "field.h"
+
+Field g_field = {0};
+
+//tile indices below are into the whole buffer with the border, which is laid out like the map's buffer
+
+static inline bool walkable(const Map *map, size_t i) {
+    return map->buffer[i] != MAP_WALL && map->buffer[i] != MAP_ANTHILL;
+}
+
+static void neighbour_offsets(const Field *field, ptrdiff_t offsets[8]) {
+    ptrdiff_t s = field->stride;
+    const ptrdiff_t all[8] = {-s - 1, -s, -s + 1, -1, 1, s - 1, s, s + 1};
+    memcpy(offsets, all, sizeof(all));
+}
+
+//the queue is a ring of field->size entries, a tile is never in it twice
+static void push(Field *field, size_t *tail, size_t i) {
+    if (field->queued[i]) return;
+    field->queued[i] = 1;
+    field->queue[*tail] = i;
+    *tail = (*tail + 1) % field->size;
+}
+
+//lower the distances around the queued tiles until nothing changes, every distance only ever decreases
+//so tiles may be queued more than once in total but the result is exact
+static void relax(Field *field, const Map *map, size_t head, size_t tail) {
+    ptrdiff_t offsets[8];
+    neighbour_offsets(field, offsets);
+    while (head != tail) {
+        size_t i = field->queue[head];
+        head = (head + 1) % field->size;
+        field->queued[i] = 0;
+        uint32_t d = field->dist[i] + 1;
+        if (d >= FIELD_FAR) continue;
+        for (int k = 0; k < 8; k++) {
+            size_t j = i + offsets[k];
+            if (field->dist[j] > d && walkable(map, j)) {
+                field->dist[j] = d;
+                push(field, &tail, j);
+            }
+        }
+    }
+}
+
+bool build_field(Field *field, const Map *map) {
+    destroy_field(field);
+    field->stride = map->stride;
+    field->offset = MAP_BORDER * map->stride + MAP_BORDER;
+    field->size = (size_t) (map->height + 2 * MAP_BORDER) * map->stride;
+    field->dist = malloc(field->size * sizeof(uint16_t));
+    field->queue = malloc(field->size * sizeof(int32_t));
+    field->queued = calloc(field->size, sizeof(uint8_t));
+    if (field->dist == NULL || field->queue == NULL || field->queued == NULL) {
+        destroy_field(field);
+        return false;
+    }
+    size_t tail = 0;
+    for (size_t i = 0; i < field->size; i++) {
+        field->dist[i] = FIELD_FAR;
+        if (map->buffer[i] == MAP_FOOD) {
+            field->dist[i] = 0;
+            push(field, &tail, i);
+        }
+    }
+    relax(field, map, 0, tail);
+    return true;
+}
+
+void destroy_field(Field *field) {
+    free(field->dist);
+    free(field->queue);
+    free(field->queued);
+    memset(field, 0, sizeof(*field));
+}
+
+void field_add_food(Field *field, const Map *map, int x, int y) {
+    if (field->dist == NULL) return;
+    size_t i = field->offset + (ptrdiff_t) y * field->stride + x;
+    size_t tail = 0;
+    field->dist[i] = 0;
+    push(field, &tail, i);
+    relax(field, map, 0, tail);
+}
+
+//tiles whose distance came through the taken leaf are cleared level by level: a tile one step further than a
+//cleared one is cleared too unless another neighbour still gives it the same distance (all tiles of a level
+//are cleared before the next level is looked at, so this is exact), then the cleared tiles are filled in
+//from their neighbours again
+void field_remove_food(Field *field, const Map *map, int x, int y) {
+    if (field->dist == NULL) return;
+    ptrdiff_t offsets[8];
+    neighbour_offsets(field, offsets);
+    size_t start = field->offset + (ptrdiff_t) y * field->stride + x;
+    if (field->dist[start] != 0) return;
+
+    int32_t *cleared = field->queue;
+    size_t cleared_num = 0, level_start = 0;
+    field->dist[start] = FIELD_FAR;
+    cleared[cleared_num++] = start;
+    for (uint32_t d = 0; level_start < cleared_num && d + 1 < FIELD_FAR; d++) {
+        size_t level_end = cleared_num;
+        for (size_t c = level_start; c < level_end; c++) {
+            for (int k = 0; k < 8; k++) {
+                size_t j = cleared[c] + offsets[k];
+                if (field->dist[j] != d + 1) continue;
+                bool supported = false;
+                for (int l = 0; l < 8 && !supported; l++)
+                    supported = field->dist[j + offsets[l]] == d;
+                if (!supported) {
+                    field->dist[j] = FIELD_FAR;
+                    cleared[cleared_num++] = j;
+                }
+            }
+        }
+        level_start = level_end;
+    }
+
+    //the cleared tiles are queued over the list itself, the queue never gets ahead of the list
+    size_t tail = 0;
+    for (size_t c = 0; c < cleared_num; c++) {
+        size_t i = cleared[c];
+        uint16_t best = FIELD_FAR;
+        for (int k = 0; k < 8; k++)
+            if (field->dist[i + offsets[k]] < best) best = field->dist[i + offsets[k]];
+        if (best < FIELD_FAR - 1) {
+            field->dist[i] = best + 1;
+            push(field, &tail, i);
+        }
+    }
+    relax(field, map, 0, tail);
+}
@@ -0,0 +1,38 @@
+#ifndef FIELD_H
+#define FIELD_H 1
+#include <stdint.h>
+#include <stdbool.h>
+#include "map.h"
+
+/* Distance field to the nearest leaf.
+ * Every tile an ant can walk on (anything but walls and the anthill) holds the number of steps,
+ * straight or diagonal, to the nearest MAP_FOOD tile, FIELD_FAR if there is none in reach.
+ * Leaves that appear or disappear update it incrementally, only tiles whose distance changes are touched.
+ * The field has the same layout and border as the tiles, so it needs a map that owns its tiles.
+ */
+
+#define FIELD_FAR UINT16_MAX
+
+typedef struct {
+    uint16_t *dist;
+    int32_t stride;
+    int32_t offset; //of tile (0, 0)
+    size_t size; //tiles including the border
+    int32_t *queue; //scratch for the updates, a tile index per tile
+    uint8_t *queued;
+} Field;
+
+extern Field g_field;
+
+//compute the whole field from scratch (any previous one is freed)
+bool build_field(Field *field, const Map *map);
+void destroy_field(Field *field);
+//a leaf appeared at (x, y) or was taken from it, the tile must already be changed on the map
+void field_add_food(Field *field, const Map *map, int x, int y);
+void field_remove_food(Field *field, const Map *map, int x, int y);
+
+//reads are safe on the border just like map_get
+static inline uint16_t field_get(const Field *field, int x, int y) {
+    return field->dist[field->offset + (ptrdiff_t) y * field->stride + x];
+}
+#endif //FIELD_H
@@ -8,7 +8,10 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <time.h>
+#include <limits.h>
 #include "map.h"
+#include "scan.h"
+#include "field.h"
 #include "cants_config.h"
 
 #define scp(pointer, message) {                                               \
@@ -35,13 +38,15 @@
 #define ttfcc(code, message) { if (code < 0) {SDL_Log("Error: %s! TTF_Error: %s", message, TTF_GetError()); exit(1);}}
 
 #define emod(a, b) (((a) % (b)) + (b)) % (b)
+//division rounding towards negative infinity (b > 0)
+#define floor_div(a, b) ((a) / (b) - ((a) % (b) < 0))
 
 int screen_width = 1920;
 int screen_height = 1080;
 int level_width = 3000;
 int level_height = 3000;
 const Uint32 ANT_ANIM_MS = 100;
-const Uint32 ANT_MS_TO_MOVE = 10;
+const Uint32 ANT_MS_TO_MOVE = 10; //simulation step
 const int ANT_VEL_MAX = 2;
 const int ANT_TURN_DEGREES = 1;
 const int CELL_SIZE = 50;
@@ -60,28 +65,67 @@ typedef struct {
     int height;
 } Texture;
 
-//Ant structs hold information needed to draw any ant
-//Player and Npc structs are used to calculate motion. There is a sort of 'inheritance' from Ant
+//Ant struct holds information needed to draw the player ant, the Player struct is used to calculate its motion
+//npcs are kept in NpcStore columns instead, see below
+
+//positions are fixed point with POS_ONE units per pixel, so movement is plain integer math
+//that gives the same result with any compiler and on any platform
+#define POS_SHIFT 8
+#define POS_ONE (1 << POS_SHIFT)
 
 typedef struct {
     int8_t frame;
     Uint32 anim_time;
-    float x;
-    float y;
+    int32_t x;
+    int32_t y;
+    int32_t prev_x; //before the last tick, drawn in between
+    int32_t prev_y;
     int angle;
     float scale;
 } Ant;
 
+//npcs are stored as a structure of arrays, so that culling, movement and rendering each stream
+//only the columns they need; an npc is referred to by its index, which stays valid until the npcs are cleared
+//all columns are carved out of a single pool allocation, which is kept when the npcs are cleared
+typedef uint32_t Npc;
+#define NPC_NONE UINT32_MAX
+
 typedef struct {
-    Ant *ant;
-    enum ANT_STATES state;
-    int target_angle;
-    int8_t cw;
-    int steps_done;
-    int gm_x; //game coordinates
-    int gm_y;
-    SDL_TimerID timer_id;
-} Npc;
+    size_t num;
+    size_t capacity;
+    void *pool;
+    //hot: position, read by every pass
+    int32_t *x;
+    int32_t *y;
+    int *angle;
+    //movement
+    int8_t *state; //enum ANT_STATES
+    int *target_angle;
+    int8_t *cw;
+    int *steps_done;
+    int *gm_x; //game coordinates
+    int *gm_y;
+    uint32_t *seed; //own random numbers, so the outcome does not depend on which thread moves the ant
+    int8_t *pickup; //reached a leaf this tick
+    //spatial grid
+    int32_t *grid_cell;
+    Npc *grid_prev;
+    Npc *grid_next;
+    int8_t *regrid; //headed into another grid cell this tick
+    //rendering
+    int32_t *prev_x; //position before the last tick, ants are drawn in between
+    int32_t *prev_y;
+    int8_t *frame;
+    Uint32 *anim_time;
+    float *scale;
+    Npc *visible; //scratch for culling
+} NpcStore;
+
+#define NPC_COLUMNS(COLUMN) \
+    COLUMN(x) COLUMN(y) COLUMN(angle) \
+    COLUMN(state) COLUMN(target_angle) COLUMN(cw) COLUMN(steps_done) COLUMN(gm_x) COLUMN(gm_y) \
+    COLUMN(seed) COLUMN(pickup) COLUMN(grid_cell) COLUMN(grid_prev) COLUMN(grid_next) COLUMN(regrid) \
+    COLUMN(prev_x) COLUMN(prev_y) COLUMN(frame) COLUMN(anim_time) COLUMN(scale) COLUMN(visible)
 
 typedef struct {
     Ant *ant;
@@ -108,16 +152,24 @@ SDL_Window* g_window;
 
 SDL_Renderer* g_renderer;
 
-Uint32 g_eventstart;
+//random streams, all derived from g_seed when a level is loaded so the same seed gives the same world
+enum RNG_STREAMS {RNG_FOOD, RNG_SPAWN, RNG_LOOKS};
+uint64_t g_seed;
+Rng g_food_rng; //where new leaves grow
+Rng g_spawn_rng; //seeds of the npcs' own streams
+Rng g_looks_rng; //ant sizes, only for the eye so it does not shift the others
+
+//leaves collected since the last frame, any thread may add to it and the main loop takes it all once per frame
+SDL_atomic_t g_food_collected;
 
 Texture g_leaf_texture;
 Texture g_background_texture;
 Texture g_ant_texture;
-Texture g_food_count_texture;
 Texture g_anthill_texture;
 Texture g_anthill_icon_texture;
-Texture g_anthill_level_texture;
-Texture g_tutorial_prompt;
+char g_food_count_text[22];
+char g_anthill_level_text[22];
+const char *g_tutorial_prompt; //NULL once the tutorial is done
 
 #if TUTORIAL
 enum TUTORIAL_STAGES g_tutorial = TUTORIAL_LEAVES;
@@ -142,6 +194,20 @@ Point g_ant_move_table[8] = {
     {-1,-1}  //315
 };
 
+//sin of 0 to 90 degrees in POS_ONE units, the direction tables are built from it without any floating point
+const int16_t g_sin_quarter[91] = {
+    0, 4, 9, 13, 18, 22, 27, 31, 36, 40, 44, 49, 53, 58, 62,
+    66, 71, 75, 79, 83, 88, 92, 96, 100, 104, 108, 112, 116, 120, 124,
+    128, 132, 136, 139, 143, 147, 150, 154, 158, 161, 165, 168, 171, 175, 178,
+    181, 184, 187, 190, 193, 196, 199, 202, 204, 207, 210, 212, 215, 217, 219,
+    222, 224, 226, 228, 230, 232, 234, 236, 237, 239, 241, 242, 243, 245, 246,
+    247, 248, 249, 250, 251, 252, 253, 254, 254, 255, 255, 255, 256, 256, 256,
+    256
+};
+//a step of one pixel in the direction of every angle (0 is up, clockwise)
+int16_t g_dir_x[360];
+int16_t g_dir_y[360];
+
 #define MAX_LEVEL 10
 //const int g_levels_table[MAX_LEVEL + 1] = {10, 20, 30, 40, 50, 60, 70, 80, 90, 100, 110, 120, 130, 140, 150, 160, 170, 180, 190, 200, 200};
 const int g_levels_table[MAX_LEVEL + 1] = {10, 20, 30, 40, 50, 60, 70, 80, 90, 100, 100};
@@ -153,19 +219,149 @@ SDL_Rect g_camera = {
     0
 };
 
-size_t g_npc_sp;
-Npc **g_npc_stack = NULL;
+//the tiles that stay put (grass and walls) are drawn once per map chunk into a texture and the chunks on the
+//screen are then copied with a draw each; textures are kept for the TILE_CACHE_SIZE chunks drawn last and a
+//chunk is drawn again when one of its walls changes
+#define TILE_CACHE_SIZE 32
+#define CHUNK_PX (MAP_CHUNK_SIZE * CELL_SIZE)
+typedef struct {
+    SDL_Texture *texture;
+    int chunk; //-1 if unused
+    Uint32 used; //frame it was last drawn in
+    bool dirty;
+} TileCacheEntry;
+TileCacheEntry g_tile_cache[TILE_CACHE_SIZE];
+int16_t *g_chunk_cache_slot; //cache entry of every map chunk, -1 if it has none
+bool g_tile_cache_ok; //render targets are supported, otherwise the chunks are drawn tile by tile
+Uint32 g_frame;
+
+//g_zoom is screen pixels per level pixel, g_camera is in level pixels (the screen size divided by the zoom)
+//and the world is drawn with the renderer's scale set to the zoom, the HUD unscaled
+float g_zoom = 1;
+#define ZOOM_STEP 1.25f
+//when cells get smaller than LOD_CELL_PX on the screen, or the chunks on it would not fit in the tile cache, the
+//world is drawn from the minimap instead, and the ants as dots; a texel of the minimap is the average colour of
+//g_minimap_scale^2 cells, as few as the renderer's largest texture allows, and is patched when one of them changes
+//changed texels are uploaded by bands of rows, each band as the span of columns changed in its rows
+#define LOD_CELL_PX 20
+#define ANT_DOT_PX 3
+#define MINIMAP_MAX_UPLOADS 16
+SDL_Texture *g_minimap;
+Uint32 *g_minimap_pixels;
+int g_minimap_scale;
+int g_minimap_w;
+int g_minimap_h;
+int *g_minimap_dirty; //first and last changed texel (2 per row) of every row, first > last if it is unchanged
+int g_minimap_dirty_y0; //changed rows, y0 > y1 if there are none
+int g_minimap_dirty_y1;
+SDL_Rect *g_ant_dots;
+size_t g_ant_dots_capacity;
+
+//the sprites of a frame that share a texture (the ants, the text) are gathered into one vertex buffer and
+//drawn with a single SDL_RenderGeometry call, without it (SDL before 2.0.18 or a renderer that fails it)
+//every sprite is an SDL_RenderCopy(Ex)
+#define SPRITE_BATCH SDL_VERSION_ATLEAST(2, 0, 18)
+#if SPRITE_BATCH
+typedef struct {
+    SDL_Vertex *vertices; //4 per sprite
+    int *indices; //6 per sprite, always filled for the whole capacity
+    int num; //sprites
+    int capacity;
+    bool failed; //SDL_RenderGeometry failed, the sprites are drawn one by one
+} SpriteBatch;
+SpriteBatch g_ant_batch;
+SpriteBatch g_text_batch;
+#endif
+
+//text is drawn from the outlined glyphs of the printable ASCII characters, rasterised once into one texture
+#define GLYPH_FIRST ' '
+#define GLYPH_LAST '~'
+#define GLYPH_ATLAS_WIDTH 1024
+typedef struct {
+    Texture atlas;
+    SDL_Rect glyphs[GLYPH_LAST - GLYPH_FIRST + 1]; //place of every glyph in the atlas, empty for blank ones
+    int advance[GLYPH_LAST - GLYPH_FIRST + 1];
+    int height; //of a line
+} GlyphAtlas;
+GlyphAtlas g_glyphs;
+
+#define ANT_STACK_INIT_SIZE 10
+
+//npcs are also linked into a uniform grid of map chunks by the tile they are heading to, so that spatial
+//queries only look at the ants in the chunks they cover; the lists are fixed up after every tick
+Npc *g_npc_grid; //first npc of every chunk
+NpcStore g_npcs;
+
+//the world is simulated in fixed steps on the main thread, g_sim_time is the time it has been advanced to
+//and g_sim_alpha how far the clock already is into the next step, the ants are drawn that far past their
+//previous position so motion stays smooth whatever the frame rate
+#define SIM_MAX_TICKS 25
+Uint32 g_sim_time;
+float g_sim_alpha;
+
+//without vsync frames are presented as fast as they are drawn and the frame rate is logged
+#define FPS_LOG_MS 5000
+bool g_vsync = true;
+Uint32 g_fps_time;
+int g_fps_frames;
+
+//npcs are moved in chunks of SIM_CHUNK by the main thread and the workers, which take the next chunk from
+//g_sim_next_chunk until there are none left; small colonies are not worth waking the workers for
+#define SIM_CHUNK 1024
+#define SIM_PARALLEL_MIN_NPCS 4096
+#define SIM_MAX_WORKERS 15
+SDL_Thread *g_sim_workers[SIM_MAX_WORKERS];
+int g_sim_workers_num;
+SDL_sem *g_sim_start;
+SDL_sem *g_sim_done;
+SDL_atomic_t g_sim_next_chunk;
+bool g_sim_quit;
 
 //////////////// FUNCTIONS //////////////////////////////////////////////////////
 
-//create a dynamically allocated stack which holds ants and is used for rendering them all
-Npc **init_npc_stack(void);
-//push an npc onto npc stack
-bool push_npc(Npc *npc);
+//grow the npc pool to hold at least capacity npcs
+bool reserve_npcs(size_t capacity);
+//create count npcs at once on the given tile, returns how many were created
+size_t spawn_npcs(size_t count, int gm_x, int gm_y);
+//remove all npcs, the pool is kept for the next ones
+void clear_npcs(void);
+//npcs heading to tiles inside [x0, x1) x [y0, y1) are put in out (room for all npcs), returns how many
+size_t npcs_in_rect(int x0, int y0, int x1, int y1, Npc *out);
+//npcs heading to tiles at most radius tiles away (either axis) from (gm_x, gm_y)
+size_t npcs_near(int gm_x, int gm_y, int radius, Npc *out);
+//threads that help moving the npcs, one less than there are cores
+void start_sim_workers(void);
+void stop_sim_workers(void);
+void init_sim(void);
+//forget the cached chunks, their textures are freed too if they were lost with the renderer
+void reset_tile_cache(bool destroy_textures);
 
 //check collision of two axis aligned rectangles
 bool check_collision(SDL_Rect x, SDL_Rect y);
 
+void init_direction_tables(void) {
+    for (int a = 0; a < 360; a++) {
+        int q = a % 90;
+        //sin over the four quarters
+        int16_t sin_a = a < 90 ? g_sin_quarter[q] : a < 180 ? g_sin_quarter[90 - q] :
+            a < 270 ? -g_sin_quarter[q] : -g_sin_quarter[90 - q];
+        int b = (a + 90) % 360, r = b % 90;
+        int16_t cos_a = b < 90 ? g_sin_quarter[r] : b < 180 ? g_sin_quarter[90 - r] :
+            b < 270 ? -g_sin_quarter[r] : -g_sin_quarter[90 - r];
+        //the y axis is inverted
+        g_dir_x[a] = sin_a;
+        g_dir_y[a] = -cos_a;
+    }
+}
+
+int min(int a, int b) {
+    return (a < b) ? a: b;
+}
+
+int max(int a, int b) {
+    return (a > b) ? a: b;
+}
+
 void init(void) {
 
 	scc(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER), "Could not initialize SDL");
@@ -187,19 +383,27 @@ void init(void) {
     g_camera.w = screen_width;
     g_camera.h = screen_height;
     //Create renderer for window
-    scp((g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC)),
+    scp((g_renderer = SDL_CreateRenderer(g_window, -1, SDL_RENDERER_ACCELERATED | (g_vsync ? SDL_RENDERER_PRESENTVSYNC : 0))),
             "Could not create renderer");
+    g_fps_time = SDL_GetTicks();
 
     int imgFlags = IMG_INIT_PNG;
     if(!( IMG_Init(imgFlags) & imgFlags)) {
         SDL_Log("SDL_image could not initialize! SDL_image Error: %s\n", IMG_GetError());
         exit(1);
     }
-    //init stack with ant pointers
-    if ((g_npc_stack = init_npc_stack()) == NULL) {
+    init_sim();
+}
+
+//everything the simulation needs, which is all there is in headless mode
+void init_sim(void) {
+    init_direction_tables();
+    //room for the first ants
+    if (!reserve_npcs(ANT_STACK_INIT_SIZE)) {
         SDL_Log("Error: Could not initialize ant stack!");
         exit(1);
     }
+    start_sim_workers();
 }
 
 //return Texture struct
@@ -225,37 +429,54 @@ Texture load_texture(const char *path)
 	return texture_struct;
 }
 
-Texture load_text_texture(const char *text){
-	SDL_Texture *new_texture = NULL;
-    SDL_Surface *text_surface = NULL;
-
+//rasterise the glyphs like the text used to be: white over a black copy, both with the outline
+void load_glyph_atlas(TTF_Font *font) {
 #define OUTLINE_SIZE 2
-    /* load font and its outline */
-    TTF_SetFontOutline(g_font, OUTLINE_SIZE);
-
-    /* render text and text outline */
+    TTF_SetFontOutline(font, OUTLINE_SIZE);
     SDL_Color white = {0xFF, 0xFF, 0xFF, 0xFF};
     SDL_Color black = {0x00, 0x00, 0x00, 0xFF};
-    text_surface = TTF_RenderText_Blended(g_font, text, black);
-    SDL_Surface *fg_surface = TTF_RenderText_Blended(g_font, text, white);
-    SDL_Rect rect = {OUTLINE_SIZE, OUTLINE_SIZE, fg_surface->w, fg_surface->h};
-
-    /* blit text onto its outline */
-    SDL_SetSurfaceBlendMode(fg_surface, SDL_BLENDMODE_BLEND);
-    SDL_BlitSurface(fg_surface, NULL, text_surface, &rect);
-    SDL_FreeSurface(fg_surface);
-
-    scp((new_texture = SDL_CreateTextureFromSurface(g_renderer, text_surface)), "Could not create texture from surface");
-
-    const Texture texture_struct = {
-        new_texture,
-        text_surface->w,
-        text_surface->h
-
-    };
-    SDL_FreeSurface(text_surface);
-
-	return texture_struct;
+    SDL_Surface *glyphs[GLYPH_LAST - GLYPH_FIRST + 1];
+    int x = 0, y = 0, line = 0;
+    for (int c = GLYPH_FIRST; c <= GLYPH_LAST; c++) {
+        int i = c - GLYPH_FIRST;
+        if (TTF_GlyphMetrics(font, c, NULL, NULL, NULL, NULL, &g_glyphs.advance[i]) < 0)
+            g_glyphs.advance[i] = 0;
+        //blank glyphs may have no surface at all
+        glyphs[i] = TTF_RenderGlyph_Blended(font, c, black);
+        SDL_Surface *fg_surface = TTF_RenderGlyph_Blended(font, c, white);
+        if (glyphs[i] != NULL && fg_surface != NULL) {
+            SDL_Rect rect = {OUTLINE_SIZE, OUTLINE_SIZE, fg_surface->w, fg_surface->h};
+            SDL_SetSurfaceBlendMode(fg_surface, SDL_BLENDMODE_BLEND);
+            SDL_BlitSurface(fg_surface, NULL, glyphs[i], &rect);
+        }
+        SDL_FreeSurface(fg_surface);
+        //glyphs are laid out in rows
+        SDL_Rect *place = &g_glyphs.glyphs[i];
+        *place = (SDL_Rect) {0, 0, 0, 0};
+        if (glyphs[i] == NULL) continue;
+        if (x + glyphs[i]->w > GLYPH_ATLAS_WIDTH) {
+            x = 0;
+            y += line;
+            line = 0;
+        }
+        *place = (SDL_Rect) {x, y, glyphs[i]->w, glyphs[i]->h};
+        x += glyphs[i]->w;
+        line = max(line, glyphs[i]->h);
+        g_glyphs.height = max(g_glyphs.height, glyphs[i]->h);
+    }
+    SDL_Surface *atlas;
+    scp((atlas = SDL_CreateRGBSurfaceWithFormat(0, GLYPH_ATLAS_WIDTH, y + line, 32, SDL_PIXELFORMAT_RGBA32)), "Could not create glyph atlas");
+    for (int i = 0; i <= GLYPH_LAST - GLYPH_FIRST; i++) {
+        if (glyphs[i] == NULL) continue;
+        //copied as they are, alpha included
+        SDL_SetSurfaceBlendMode(glyphs[i], SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(glyphs[i], NULL, atlas, &g_glyphs.glyphs[i]);
+        SDL_FreeSurface(glyphs[i]);
+    }
+    scp((g_glyphs.atlas.texture_proper = SDL_CreateTextureFromSurface(g_renderer, atlas)), "Could not create texture from surface");
+    g_glyphs.atlas.width = atlas->w;
+    g_glyphs.atlas.height = atlas->h;
+    SDL_FreeSurface(atlas);
 }
 
 void load_media() {
@@ -269,17 +490,37 @@ void load_media() {
     g_background_texture = load_texture(ASSETS_PREFIX"grass500x500.png");
     //"https://www.freepik.com/vectors/cartoon-grass" Cartoon grass vector created by babysofja - www.freepik.com
     g_leaf_texture = load_texture(ASSETS_PREFIX"leaf.png");
-    g_font = TTF_OpenFont(ASSETS_PREFIX"OpenSans-Regular.ttf", 50);
-    assert(g_levels_table[0] == 10 && "wrong first level in a texture");
-    g_food_count_texture = load_text_texture("0/10");
+    ttfcp((g_font = TTF_OpenFont(ASSETS_PREFIX"OpenSans-Regular.ttf", 50)), "Could not open font");
+    load_glyph_atlas(g_font);
+    assert(g_levels_table[0] == 10 && "wrong first level in the HUD");
+    strcpy(g_food_count_text, "0/10");
     g_anthill_texture = load_texture(ASSETS_PREFIX"anthill.png");
     g_anthill_icon_texture = load_texture(ASSETS_PREFIX"anthill_icon.png");
-    g_anthill_level_texture = load_text_texture("1/"STR(MAX_LEVEL));
-    g_tutorial_prompt = load_text_texture("Use WASD to move around and collect leaves");
+    strcpy(g_anthill_level_text, "1/"STR(MAX_LEVEL));
+    g_tutorial_prompt = "Use WASD to move around and collect leaves";
 }
 
 void closesdl()
 {
+    stop_sim_workers();
+    reset_tile_cache(true);
+    free(g_chunk_cache_slot);
+    g_chunk_cache_slot = NULL;
+#if SPRITE_BATCH
+    free(g_ant_batch.vertices);
+    free(g_ant_batch.indices);
+    free(g_text_batch.vertices);
+    free(g_text_batch.indices);
+#endif
+    SDL_DestroyTexture(g_glyphs.atlas.texture_proper);
+    g_glyphs.atlas.texture_proper = NULL;
+    SDL_DestroyTexture(g_minimap);
+    g_minimap = NULL;
+    free(g_minimap_pixels);
+    g_minimap_pixels = NULL;
+    free(g_minimap_dirty);
+    g_minimap_dirty = NULL;
+    free(g_ant_dots);
 	//Free loaded image
 	SDL_DestroyTexture(g_ant_texture.texture_proper);
     g_ant_texture.texture_proper = NULL;
@@ -287,8 +528,6 @@ void closesdl()
     g_background_texture.texture_proper = NULL;
     SDL_DestroyTexture(g_leaf_texture.texture_proper);
     g_background_texture.texture_proper = NULL;
-    SDL_DestroyTexture(g_food_count_texture.texture_proper);
-    g_background_texture.texture_proper = NULL;
     SDL_DestroyTexture(g_anthill_texture.texture_proper);
     g_background_texture.texture_proper = NULL;
     SDL_DestroyTexture(g_anthill_icon_texture.texture_proper);
@@ -312,43 +551,146 @@ Ant *create_ant(int x, int y) {
     }
     memset((void *) ant, 0, sizeof(Ant));
     ant->anim_time = SDL_GetTicks();
-    ant->x = x;
-    ant->y = y;
+    ant->x = ant->prev_x = x * POS_ONE;
+    ant->y = ant->prev_y = y * POS_ONE;
 
-    ant->scale = (double) rand() / RAND_MAX + 0.75;
+    ant->scale = rng_float(&g_looks_rng) + 0.75;
 #if DEBUGMODE
-    SDL_Log("Ant #%ld created at x %d y %d\n", g_npc_sp, (int) ant->x, (int) ant->y);
+    SDL_Log("Player placed at x %d y %d\n", ant->x / POS_ONE, ant->y / POS_ONE);
 #endif
     return ant;
 }
 
+#if SPRITE_BATCH
+//room for at least capacity sprites, the batch is left as it was on failure
+static bool reserve_sprites(SpriteBatch *batch, int capacity) {
+    if (capacity <= batch->capacity) return true;
+    capacity = max(capacity, batch->capacity * 2);
+    SDL_Vertex *vertices = realloc(batch->vertices, (size_t) capacity * 4 * sizeof(SDL_Vertex));
+    if (vertices == NULL) return false;
+    batch->vertices = vertices;
+    int *indices = realloc(batch->indices, (size_t) capacity * 6 * sizeof(int));
+    if (indices == NULL) return false;
+    batch->indices = indices;
+    //two triangles per quad
+    for (int i = batch->capacity; i < capacity; i++) {
+        const int quad[6] = {0, 1, 2, 2, 3, 0};
+        for (int k = 0; k < 6; k++)
+            indices[i * 6 + k] = i * 4 + quad[k];
+    }
+    batch->capacity = capacity;
+    return true;
+}
+
+//append the clip rect of the texture drawn to the corners xy (clockwise from the top left), false if there is no room
+static bool batch_sprite(SpriteBatch *batch, const Texture *texture, const SDL_Rect *clip, const SDL_FPoint xy[4]) {
+    if (batch->failed || !reserve_sprites(batch, batch->num + 1)) return false;
+    float u0 = (float) clip->x / texture->width, u1 = (float) (clip->x + clip->w) / texture->width;
+    float v0 = (float) clip->y / texture->height, v1 = (float) (clip->y + clip->h) / texture->height;
+    const SDL_FPoint uv[4] = {{u0, v0}, {u1, v0}, {u1, v1}, {u0, v1}};
+    SDL_Vertex *vertex = &batch->vertices[batch->num * 4];
+    for (int k = 0; k < 4; k++) {
+        vertex[k].position = xy[k];
+        vertex[k].color = (SDL_Color) {0xFF, 0xFF, 0xFF, 0xFF};
+        vertex[k].tex_coord = uv[k];
+    }
+    batch->num++;
+    return true;
+}
+
+static void flush_batch(SpriteBatch *batch, SDL_Texture *texture) {
+    if (batch->num > 0 && SDL_RenderGeometry(g_renderer, texture, batch->vertices, batch->num * 4, batch->indices, batch->num * 6) < 0) {
+        SDL_Log("Warning: could not draw a sprite batch, its sprites are drawn one by one from now on: %s", SDL_GetError());
+        batch->failed = true;
+    }
+    batch->num = 0;
+}
+#endif
+
+//where something that moved from prev to cur during the last tick is drawn this frame
+static inline int32_t lerp_pos(int32_t prev, int32_t cur) {
+    return prev + (int32_t) lroundf((cur - prev) * g_sim_alpha);
+}
+
+//an ant sprite centred on (x, y) in level units (fixed point), turned clockwise by angle degrees
+void draw_ant(int8_t frame, int32_t x, int32_t y, float scale, int angle) {
+    float w = g_antframes[0].w * scale, h = g_antframes[0].h * scale;
+#if SPRITE_BATCH
+    //the corners are turned around the centre with the direction tables
+    int a = emod(angle, 360);
+    float sin_a = (float) g_dir_x[a] / POS_ONE, cos_a = (float) -g_dir_y[a] / POS_ONE;
+    float cx = (float) x / POS_ONE - g_camera.x, cy = (float) y / POS_ONE - g_camera.y;
+    const float corners[4][2] = {{-w / 2, -h / 2}, {w / 2, -h / 2}, {w / 2, h / 2}, {-w / 2, h / 2}};
+    SDL_FPoint xy[4];
+    for (int k = 0; k < 4; k++) {
+        xy[k].x = cx + corners[k][0] * cos_a - corners[k][1] * sin_a;
+        xy[k].y = cy + corners[k][0] * sin_a + corners[k][1] * cos_a;
+    }
+    if (batch_sprite(&g_ant_batch, &g_ant_texture, &g_antframes[frame], xy))
+        return;
+#endif
+    SDL_Rect render_rect = {x / POS_ONE - g_camera.x - w / 2, y / POS_ONE - g_camera.y - h / 2, w, h};
+    SDL_RenderCopyEx(g_renderer, g_ant_texture.texture_proper, &g_antframes[frame], &render_rect, angle, NULL, SDL_FLIP_NONE);
+}
+
+//draw the batched ants, before anything that goes over them
+void flush_ants(void) {
+#if SPRITE_BATCH
+    flush_batch(&g_ant_batch, g_ant_texture.texture_proper);
+#endif
+}
+
+int text_width(const char *text) {
+    int width = 0;
+    for (; *text != '\0'; text++)
+        if (*text >= GLYPH_FIRST && *text <= GLYPH_LAST)
+            width += g_glyphs.advance[*text - GLYPH_FIRST];
+    return width;
+}
+
+//text with its top left corner at (x, y) on the screen, characters without a glyph are skipped
+void draw_text(const char *text, int x, int y) {
+    for (; *text != '\0'; text++) {
+        if (*text < GLYPH_FIRST || *text > GLYPH_LAST) continue;
+        int i = *text - GLYPH_FIRST;
+        const SDL_Rect *clip = &g_glyphs.glyphs[i];
+        if (clip->w > 0) {
+#if SPRITE_BATCH
+            const SDL_FPoint xy[4] = {{x, y}, {x + clip->w, y}, {x + clip->w, y + clip->h}, {x, y + clip->h}};
+            if (!batch_sprite(&g_text_batch, &g_glyphs.atlas, clip, xy))
+#endif
+            {
+                SDL_Rect render_rect = {x, y, clip->w, clip->h};
+                SDL_RenderCopy(g_renderer, g_glyphs.atlas.texture_proper, clip, &render_rect);
+            }
+        }
+        x += g_glyphs.advance[i];
+    }
+}
+
+void flush_text(void) {
+#if SPRITE_BATCH
+    flush_batch(&g_text_batch, g_glyphs.atlas.texture_proper);
+#endif
+}
+
 void render_player_anim(Player *player) {
     if (SDL_GetTicks() - player->ant->anim_time > ANT_ANIM_MS && (player->vel != 0 || player->turn_vel != 0)) {
         player->ant->anim_time = SDL_GetTicks();
         player->ant->frame = (player->ant->frame + 1) % ANT_FRAMES_NUM;
     }
-    SDL_Rect render_rect = {
-        .x = player->ant->x - g_camera.x - g_ant_texture.width * player->ant->scale / ANT_FRAMES_NUM / 2,
-        .y = player->ant->y - g_camera.y - g_ant_texture.height * player->ant->scale / 2,
-        .w = g_antframes[0].w * player->ant->scale,
-        .h = g_antframes[0].h * player->ant->scale,
-    };
-    SDL_RenderCopyEx(g_renderer, g_ant_texture.texture_proper, &g_antframes[player->ant->frame], &render_rect, player->ant->angle, NULL, SDL_FLIP_NONE);
-
+    draw_ant(player->ant->frame, lerp_pos(player->ant->prev_x, player->ant->x), lerp_pos(player->ant->prev_y, player->ant->y),
+            player->ant->scale, player->ant->angle);
 }
 
-void render_ant_anim(Ant *ant) {
-    if (SDL_GetTicks() - ant->anim_time > ANT_ANIM_MS) {
-        ant->anim_time = SDL_GetTicks();
-        ant->frame = (ant->frame + 1) % ANT_FRAMES_NUM;
+//(x, y) is where the npc is drawn this frame
+void render_npc_anim(Npc npc, int32_t x, int32_t y) {
+    NpcStore *s = &g_npcs;
+    if (SDL_GetTicks() - s->anim_time[npc] > ANT_ANIM_MS) {
+        s->anim_time[npc] = SDL_GetTicks();
+        s->frame[npc] = (s->frame[npc] + 1) % ANT_FRAMES_NUM;
     }
-    SDL_Rect render_rect = {
-        .x = ant->x - g_camera.x - g_ant_texture.width * ant->scale / ANT_FRAMES_NUM / 2,
-        .y = ant->y - g_camera.y - g_ant_texture.height * ant->scale / 2,
-        .w = g_antframes[0].w * ant->scale,
-        .h = g_antframes[0].h * ant->scale,
-    };
-    SDL_RenderCopyEx(g_renderer, g_ant_texture.texture_proper, &g_antframes[ant->frame], &render_rect, ant->angle, NULL, SDL_FLIP_NONE);
+    draw_ant(s->frame[npc], x, y, s->scale[npc], s->angle[npc]);
 }
 
 void render_texture(Texture texture, int x, int y) {
@@ -369,10 +711,40 @@ void render_texture_scaled(Texture texture, int x, int y, float scale) {
     SDL_RenderCopy(g_renderer, texture.texture_proper, NULL, &render_rect);
 }
 
+void present_frame(void) {
+    SDL_RenderPresent(g_renderer);
+    if (g_vsync) return;
+    g_fps_frames++;
+    Uint32 now = SDL_GetTicks();
+    if (now - g_fps_time >= FPS_LOG_MS) {
+        SDL_Log("%.1f frames per second\n", g_fps_frames * 1000.0 / (now - g_fps_time));
+        g_fps_time = now;
+        g_fps_frames = 0;
+    }
+}
+
+//map chunks the camera may cross
+static int camera_chunks(void) {
+    return (g_camera.w / CHUNK_PX + 2) * (g_camera.h / CHUNK_PX + 2);
+}
+
+//zoom between 1:1 and the whole level on the screen, without a minimap only as far out as the tile cache holds
+void set_zoom(float zoom) {
+    float min_zoom = fminf(1, fminf((float) screen_width / level_width, (float) screen_height / level_height));
+    g_zoom = fmaxf(min_zoom, fminf(zoom, 1));
+    g_camera.w = ceilf(screen_width / g_zoom);
+    g_camera.h = ceilf(screen_height / g_zoom);
+    while (g_renderer != NULL && g_minimap == NULL && camera_chunks() > TILE_CACHE_SIZE && g_zoom < 1) {
+        g_zoom = fminf(g_zoom * ZOOM_STEP, 1);
+        g_camera.w = ceilf(screen_width / g_zoom);
+        g_camera.h = ceilf(screen_height / g_zoom);
+    }
+}
+
 void set_camera(Player *player) {
     //Center the camera over the player
-    g_camera.x = ((int) player->ant->x + g_ant_texture.width / (2 * ANT_FRAMES_NUM)) - screen_width / 2;
-    g_camera.y = ((int) player->ant->y + g_ant_texture.height / 2) - screen_height / 2;
+    g_camera.x = (lerp_pos(player->ant->prev_x, player->ant->x) / POS_ONE + g_ant_texture.width / (2 * ANT_FRAMES_NUM)) - g_camera.w / 2;
+    g_camera.y = (lerp_pos(player->ant->prev_y, player->ant->y) / POS_ONE + g_ant_texture.height / 2) - g_camera.h / 2;
 
     //Keep the camera in bounds
     if(g_camera.x < 0) {
@@ -387,20 +759,278 @@ void set_camera(Player *player) {
     if(g_camera.y > level_height - g_camera.h) {
         g_camera.y = level_height - g_camera.h;
     }
+    //a level smaller than the screen is centred
+    if (g_camera.w > level_width)
+        g_camera.x = (level_width - g_camera.w) / 2;
+    if (g_camera.h > level_height)
+        g_camera.y = (level_height - g_camera.h) / 2;
 }
 
-void remove_food(int8_t *cell) {
-    *cell = MAP_FREE;
-    SDL_Event event;
-    SDL_UserEvent userevent;
-    event.type = SDL_USEREVENT;
-    userevent.type = g_eventstart;
-    event.user = userevent;
-    SDL_PushEvent(&event);
+//draw the grass and walls of a chunk with its top left corner at (dx, dy) on the current render target
+static void draw_static_tiles(int cx, int cy, int dx, int dy) {
+    int px = cx * CHUNK_PX, py = cy * CHUNK_PX;
+    SDL_SetRenderDrawColor(g_renderer, 0x00, 0x90, 0x00, 0xFF);
+    SDL_Rect all = {dx, dy, CHUNK_PX, CHUNK_PX};
+    SDL_RenderFillRect(g_renderer, &all);
+    //walls have the colour of the fill, so a chunk of only walls is done and one without any needs only the grass
+    int uniform = map_chunk_uniform(&g_map, cx, cy);
+    if (uniform == MAP_WALL) return;
+    //the grass is laid from the level origin
+    int grass_w = g_background_texture.width, grass_h = g_background_texture.height;
+    for (int y = py / grass_h * grass_h; y < min(py + CHUNK_PX, level_height); y += grass_h)
+        for (int x = px / grass_w * grass_w; x < min(px + CHUNK_PX, level_width); x += grass_w)
+            render_texture(g_background_texture, x - px + dx, y - py + dy);
+    if (uniform != -1) return;
+    int x0 = cx * MAP_CHUNK_SIZE, x1 = min(x0 + MAP_CHUNK_SIZE, g_map.width);
+    for (int i = cy * MAP_CHUNK_SIZE; i < min((cy + 1) * MAP_CHUNK_SIZE, g_map.height); i++)
+        for (int j = map_plane_next(&g_map, MAP_WALL, i, x0, x1); j != -1; j = map_plane_next(&g_map, MAP_WALL, i, j + 1, x1)) {
+            SDL_Rect coords = {j * CELL_SIZE - px + dx, i * CELL_SIZE - py + dy, CELL_SIZE, CELL_SIZE};
+            SDL_RenderFillRect(g_renderer, &coords);
+        }
+}
+
+//the chunk's texture, drawn first if it is not cached yet or changed; NULL if it can not be cached
+static SDL_Texture *cached_chunk(int cx, int cy) {
+    int chunk = cy * g_map.chunks_w + cx;
+    int slot = g_chunk_cache_slot[chunk];
+    if (slot == -1) {
+        //an unused entry or the one drawn longest ago
+        slot = 0;
+        for (int i = 1; i < TILE_CACHE_SIZE; i++)
+            if (g_tile_cache[i].used < g_tile_cache[slot].used) slot = i;
+        TileCacheEntry *entry = &g_tile_cache[slot];
+        if (entry->chunk != -1) {
+            g_chunk_cache_slot[entry->chunk] = -1;
+            entry->chunk = -1;
+        }
+        if (entry->texture == NULL &&
+                (entry->texture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, CHUNK_PX, CHUNK_PX)) == NULL)
+            return NULL;
+        entry->chunk = chunk;
+        entry->dirty = true;
+        g_chunk_cache_slot[chunk] = slot;
+    }
+    TileCacheEntry *entry = &g_tile_cache[slot];
+    entry->used = g_frame;
+    if (entry->dirty) {
+        if (SDL_SetRenderTarget(g_renderer, entry->texture) < 0)
+            return NULL;
+        draw_static_tiles(cx, cy, 0, 0);
+        SDL_SetRenderTarget(g_renderer, NULL);
+        entry->dirty = false;
+    }
+    return entry->texture;
+}
+
+void render_static_tiles(void) {
+    g_frame++;
+    int first_cx = max(g_camera.x / CHUNK_PX, 0), last_cx = min((g_camera.x + g_camera.w - 1) / CHUNK_PX + 1, g_map.chunks_w);
+    int first_cy = max(g_camera.y / CHUNK_PX, 0), last_cy = min((g_camera.y + g_camera.h - 1) / CHUNK_PX + 1, g_map.chunks_h);
+    for (int cy = first_cy; cy < last_cy; cy++)
+        for (int cx = first_cx; cx < last_cx; cx++) {
+            int dx = cx * CHUNK_PX - g_camera.x, dy = cy * CHUNK_PX - g_camera.y;
+            SDL_Texture *texture = g_tile_cache_ok ? cached_chunk(cx, cy) : NULL;
+            if (texture != NULL) {
+                SDL_Rect coords = {dx, dy, CHUNK_PX, CHUNK_PX};
+                SDL_RenderCopy(g_renderer, texture, NULL, &coords);
+            }
+            else
+                draw_static_tiles(cx, cy, dx, dy);
+        }
+}
+
+void reset_tile_cache(bool destroy_textures) {
+    for (int i = 0; i < TILE_CACHE_SIZE; i++) {
+        TileCacheEntry *entry = &g_tile_cache[i];
+        if (destroy_textures) {
+            SDL_DestroyTexture(entry->texture);
+            entry->texture = NULL;
+        }
+        if (entry->chunk != -1 && g_chunk_cache_slot != NULL)
+            g_chunk_cache_slot[entry->chunk] = -1;
+        entry->chunk = -1;
+        entry->used = 0;
+    }
+}
+
+//a new map has been loaded, there is nothing to cache without a renderer (headless)
+void init_tile_cache(void) {
+    if (g_renderer == NULL) return;
+    for (int i = 0; i < TILE_CACHE_SIZE; i++)
+        g_tile_cache[i].chunk = -1;
+    free(g_chunk_cache_slot);
+    size_t chunks = (size_t) g_map.chunks_w * g_map.chunks_h;
+    if ((g_chunk_cache_slot = malloc(chunks * sizeof(int16_t))) == NULL) {
+        SDL_Log("Warning: could not allocate the tile cache, tiles are drawn one by one\n");
+        g_tile_cache_ok = false;
+        return;
+    }
+    for (size_t i = 0; i < chunks; i++)
+        g_chunk_cache_slot[i] = -1;
+    g_tile_cache_ok = SDL_RenderTargetSupported(g_renderer);
+}
+
+//the tiles as they look from afar
+static Uint32 minimap_color(int8_t tile) {
+    switch (tile) {
+        case MAP_WALL:
+            return 0xFF009000;
+        case MAP_FOOD:
+            return 0xFF689D23;
+        case MAP_ANTHILL:
+            return 0xFF7A5230;
+        default:
+            return 0xFFA1C20F;
+    }
+}
+
+//average colour of the cells of texel (x, y)
+static Uint32 minimap_texel(int x, int y) {
+    int x0 = x * g_minimap_scale, y0 = y * g_minimap_scale;
+    int x1 = min(x0 + g_minimap_scale, g_map.width), y1 = min(y0 + g_minimap_scale, g_map.height);
+    Uint32 r = 0, g = 0, b = 0;
+    for (int i = y0; i < y1; i++) {
+        const int8_t *row = map_row(&g_map, i);
+        for (int j = x0; j < x1; j++) {
+            Uint32 color = minimap_color(row[j]);
+            r += color >> 16 & 0xFF;
+            g += color >> 8 & 0xFF;
+            b += color & 0xFF;
+        }
+    }
+    Uint32 cells = (x1 - x0) * (y1 - y0);
+    return 0xFF000000 | r / cells << 16 | g / cells << 8 | b / cells;
+}
+
+static void minimap_touch(int x, int y) {
+    int *dirty = &g_minimap_dirty[y * 2];
+    dirty[0] = min(dirty[0], x);
+    dirty[1] = max(dirty[1], x);
+    g_minimap_dirty_y0 = min(g_minimap_dirty_y0, y);
+    g_minimap_dirty_y1 = max(g_minimap_dirty_y1, y);
+}
+
+//a new map has been loaded, there is no minimap without a renderer (headless), the zoom is limited then
+void init_minimap(void) {
+    if (g_renderer == NULL) return;
+    SDL_DestroyTexture(g_minimap);
+    free(g_minimap_pixels);
+    free(g_minimap_dirty);
+    //0 is no limit
+    SDL_RendererInfo info = {0};
+    SDL_GetRendererInfo(g_renderer, &info);
+    g_minimap_scale = 1;
+    while ((info.max_texture_width > 0 && (g_map.width + g_minimap_scale - 1) / g_minimap_scale > info.max_texture_width) ||
+            (info.max_texture_height > 0 && (g_map.height + g_minimap_scale - 1) / g_minimap_scale > info.max_texture_height))
+        g_minimap_scale++;
+    g_minimap_w = (g_map.width + g_minimap_scale - 1) / g_minimap_scale;
+    g_minimap_h = (g_map.height + g_minimap_scale - 1) / g_minimap_scale;
+    g_minimap_pixels = malloc((size_t) g_minimap_w * g_minimap_h * sizeof(Uint32));
+    g_minimap_dirty = malloc((size_t) g_minimap_h * 2 * sizeof(int));
+    g_minimap = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, g_minimap_w, g_minimap_h);
+    if (g_minimap_pixels == NULL || g_minimap_dirty == NULL || g_minimap == NULL) {
+        SDL_Log("Warning: could not create the minimap, the zoom is limited to what the tile cache holds: %s", SDL_GetError());
+        SDL_DestroyTexture(g_minimap);
+        free(g_minimap_pixels);
+        free(g_minimap_dirty);
+        g_minimap = NULL;
+        g_minimap_pixels = NULL;
+        g_minimap_dirty = NULL;
+        return;
+    }
+#if SDL_VERSION_ATLEAST(2, 0, 12)
+    SDL_SetTextureScaleMode(g_minimap, SDL_ScaleModeNearest);
+#endif
+    if (g_minimap_scale > 1)
+        SDL_Log("Minimap %dx%d, a texel per %dx%d cells\n", g_minimap_w, g_minimap_h, g_minimap_scale, g_minimap_scale);
+    g_minimap_dirty_y0 = INT_MAX;
+    g_minimap_dirty_y1 = -1;
+    for (int i = 0; i < g_minimap_h; i++) {
+        g_minimap_dirty[i * 2] = INT_MAX;
+        g_minimap_dirty[i * 2 + 1] = -1;
+        for (int j = 0; j < g_minimap_w; j++)
+            g_minimap_pixels[(size_t) i * g_minimap_w + j] = minimap_texel(j, i);
+        minimap_touch(0, i);
+        minimap_touch(g_minimap_w - 1, i);
+    }
+}
+
+//upload the rows [y0, y1) between columns x0 and x1 inclusive
+static void upload_minimap_band(int y0, int y1, int x0, int x1) {
+    SDL_Rect rect = {x0, y0, x1 - x0 + 1, y1 - y0};
+    SDL_UpdateTexture(g_minimap, &rect, &g_minimap_pixels[(size_t) y0 * g_minimap_w + x0], g_minimap_w * sizeof(Uint32));
+}
+
+//consecutive changed rows go up together, if there are too many bands the whole span of changed rows does
+static void upload_minimap(void) {
+    if (g_minimap_dirty_y0 > g_minimap_dirty_y1) return;
+    int bands = 0, span_x0 = INT_MAX, span_x1 = -1;
+    for (int i = g_minimap_dirty_y0; i <= g_minimap_dirty_y1; i++) {
+        bool dirty = g_minimap_dirty[i * 2] <= g_minimap_dirty[i * 2 + 1];
+        bands += dirty && (i == g_minimap_dirty_y0 || g_minimap_dirty[i * 2 - 2] > g_minimap_dirty[i * 2 - 1]);
+        span_x0 = min(span_x0, g_minimap_dirty[i * 2]);
+        span_x1 = max(span_x1, g_minimap_dirty[i * 2 + 1]);
+    }
+    if (bands > MINIMAP_MAX_UPLOADS)
+        upload_minimap_band(g_minimap_dirty_y0, g_minimap_dirty_y1 + 1, span_x0, span_x1);
+    int band_y0 = -1, band_x0 = INT_MAX, band_x1 = -1;
+    for (int i = g_minimap_dirty_y0; i <= g_minimap_dirty_y1 + 1; i++) {
+        bool dirty = i <= g_minimap_dirty_y1 && g_minimap_dirty[i * 2] <= g_minimap_dirty[i * 2 + 1];
+        if (dirty) {
+            if (band_y0 == -1) band_y0 = i;
+            band_x0 = min(band_x0, g_minimap_dirty[i * 2]);
+            band_x1 = max(band_x1, g_minimap_dirty[i * 2 + 1]);
+            g_minimap_dirty[i * 2] = INT_MAX;
+            g_minimap_dirty[i * 2 + 1] = -1;
+        }
+        else if (band_y0 != -1) {
+            if (bands <= MINIMAP_MAX_UPLOADS)
+                upload_minimap_band(band_y0, i, band_x0, band_x1);
+            band_y0 = -1;
+            band_x0 = INT_MAX;
+            band_x1 = -1;
+        }
+    }
+    g_minimap_dirty_y0 = INT_MAX;
+    g_minimap_dirty_y1 = -1;
+}
+
+void render_minimap(void) {
+    upload_minimap();
+    SDL_Rect coords = {-g_camera.x, -g_camera.y, level_width, level_height};
+    SDL_RenderCopy(g_renderer, g_minimap, NULL, &coords);
+}
+
+static bool use_minimap(void) {
+    return g_minimap != NULL && (g_zoom * CELL_SIZE < LOD_CELL_PX || camera_chunks() > TILE_CACHE_SIZE);
+}
+
+//all changes of the map in the game go through here, so the cached chunks see their walls change and the
+//minimap is patched
+void set_tile(int gm_x, int gm_y, int8_t tile) {
+    int8_t old = map_get(&g_map, gm_x, gm_y);
+    map_set(&g_map, gm_x, gm_y, tile);
+    if (g_minimap_pixels != NULL) {
+        int x = gm_x / g_minimap_scale, y = gm_y / g_minimap_scale;
+        g_minimap_pixels[(size_t) y * g_minimap_w + x] = minimap_texel(x, y);
+        minimap_touch(x, y);
+    }
+    if ((old == MAP_WALL || tile == MAP_WALL) && g_chunk_cache_slot != NULL) {
+        int slot = g_chunk_cache_slot[(gm_y / MAP_CHUNK_SIZE) * g_map.chunks_w + gm_x / MAP_CHUNK_SIZE];
+        if (slot != -1)
+            g_tile_cache[slot].dirty = true;
+    }
+}
+
+void remove_food(int gm_x, int gm_y) {
+    set_tile(gm_x, gm_y, MAP_FREE);
+    field_remove_food(&g_field, &g_map, gm_x, gm_y);
+    SDL_AtomicAdd(&g_food_collected, 1);
 }
 
-Uint32 move_player(Uint32 interval, void *player_void) {
-    Player *player = (Player *) player_void;
+void move_player(Player *player) {
+    player->ant->prev_x = player->ant->x;
+    player->ant->prev_y = player->ant->y;
 
     if (player->vel >= 0)
         player->ant->angle += player->turn_vel;
@@ -409,15 +1039,18 @@ Uint32 move_player(Uint32 interval, void *player_void) {
 
     if (player->vel != 0) {
                                         //convert angle to radians
-        float dx = cosf((player->ant->angle - 90) * M_PI / 180.0);
-        float dy = sinf((player->ant->angle - 90) * M_PI / 180.0);
-        player->ant->x += player->vel * dx;
-        player->ant->y += player->vel * dy;
+        int angle = emod(player->ant->angle, 360);
+        int32_t dx = player->vel * g_dir_x[angle];
+        int32_t dy = player->vel * g_dir_y[angle];
+        player->ant->x += dx;
+        player->ant->y += dy;
         //collision checks
-        //TODO: accessing the map with the player outside of the map may segfault
+        //rounded down, so stepping off the top or left edge reads the border walls, which push the player back
+        //(the player never gets further than one step past a wall, so this stays inside the border)
         //Circular collision might be worth it
-        int8_t *cell = &g_map.matrix[(int) player->ant->y / CELL_SIZE][(int) player->ant->x / CELL_SIZE];
-        switch (*cell) {
+        int gm_x = floor_div(player->ant->x, POS_ONE * CELL_SIZE);
+        int gm_y = floor_div(player->ant->y, POS_ONE * CELL_SIZE);
+        switch (map_get(&g_map, gm_x, gm_y)) {
             case MAP_FREE:
                 player->in_anthill = false;
                 break;
@@ -425,154 +1058,352 @@ Uint32 move_player(Uint32 interval, void *player_void) {
                 player->in_anthill = true;
                 /* FALLTHRU */
             case MAP_WALL:
-                player->ant->x -= player->vel * dx;
-                player->ant->y -= player->vel * dy;
+                player->ant->x -= dx;
+                player->ant->y -= dy;
                 break;
             case MAP_FOOD:
-                remove_food(cell);
+                remove_food(gm_x, gm_y);
                 break;
         }
     }
+}
 
+void update_food_count_text(int food_count, int next_level) {
+    sprintf(g_food_count_text, "%d/%d", food_count, next_level);
+}
+void update_anthill_level_text(int level) {
+    sprintf(g_anthill_level_text, "%d/%d", level, MAX_LEVEL);
+}
 
-    return interval;
+static inline int32_t npc_grid_cell(int gm_x, int gm_y) {
+    return (gm_y / MAP_CHUNK_SIZE) * g_map.chunks_w + gm_x / MAP_CHUNK_SIZE;
 }
 
-void update_food_count_texture(int food_count, int next_level) {
-    char str[22];
-    sprintf(str, "%d/%d", food_count, next_level);
-    SDL_DestroyTexture(g_food_count_texture.texture_proper);
-    g_food_count_texture = load_text_texture(str);
+static void grid_link(Npc npc) {
+    NpcStore *s = &g_npcs;
+    int32_t cell = npc_grid_cell(s->gm_x[npc], s->gm_y[npc]);
+    s->grid_cell[npc] = cell;
+    s->grid_prev[npc] = NPC_NONE;
+    s->grid_next[npc] = g_npc_grid[cell];
+    if (g_npc_grid[cell] != NPC_NONE)
+        s->grid_prev[g_npc_grid[cell]] = npc;
+    g_npc_grid[cell] = npc;
 }
-void update_anthill_level_texture(int level) {
-    char str[22];
-    sprintf(str, "%d/%d", level, MAX_LEVEL);
-    SDL_DestroyTexture(g_anthill_level_texture.texture_proper);
-    g_anthill_level_texture = load_text_texture(str);
+
+static void grid_unlink(Npc npc) {
+    NpcStore *s = &g_npcs;
+    if (s->grid_prev[npc] != NPC_NONE)
+        s->grid_next[s->grid_prev[npc]] = s->grid_next[npc];
+    else
+        g_npc_grid[s->grid_cell[npc]] = s->grid_next[npc];
+    if (s->grid_next[npc] != NPC_NONE)
+        s->grid_prev[s->grid_next[npc]] = s->grid_prev[npc];
 }
 
-Uint32 move_npc(Uint32 interval, void *npc_void) {
+//the npc's own stream
+static uint32_t npc_rand(Npc npc) {
+    return g_npcs.seed[npc] = xorshift32(g_npcs.seed[npc]);
+}
 
-    Npc *npc = (Npc *) npc_void;
-    switch (npc->state) {
+//only reads the map, a leaf that was reached is marked in pickup and taken by collect_food after the tick,
+//a new grid cell is marked in regrid for regrid_npcs
+void move_npc(Npc npc) {
+    NpcStore *s = &g_npcs;
+    s->prev_x[npc] = s->x[npc];
+    s->prev_y[npc] = s->y[npc];
+    switch (s->state[npc]) {
         case ANT_STATE_PREPARE:;
 
-            Point target_cell = {-1, -1};
-
-            for (int i = 0; i < 8; i++) {
-                int gm_x = npc->gm_x + g_ant_move_table[i].x;
-                int gm_y = npc->gm_y + g_ant_move_table[i].y;
-                if (g_map.matrix[gm_y][gm_x] == MAP_FOOD) {
-                    target_cell.x = gm_x;
-                    target_cell.y = gm_y;
-                    npc->target_angle = i * 45;
+            int dir = -1;
+            //the whole neighbourhood is read from the bit planes at once,
+            //neighbours of a tile on the map are at worst border walls, no bounds checks needed
+            unsigned food = map_neighbours(&g_map, MAP_FOOD, s->gm_x[npc], s->gm_y[npc]);
+            unsigned blocked = map_neighbours(&g_map, MAP_WALL, s->gm_x[npc], s->gm_y[npc]) |
+                map_neighbours(&g_map, MAP_ANTHILL, s->gm_x[npc], s->gm_y[npc]);
+
+            for (int i = 0; i < 8 && food != 0; i++) {
+                Point offset = g_ant_move_table[i];
+                if (food & MAP_NEIGHBOUR_BIT(offset.x, offset.y))
+                    dir = i;
+            }
+            if (dir == -1) {
+                //head down the distance field towards the nearest leaf (blocked cells are never closer),
+                //equally close cells are tried from a random one so that the ants spread out
+                uint16_t best = field_get(&g_field, s->gm_x[npc], s->gm_y[npc]);
+                int first = npc_rand(npc) % 8;
+                for (int k = 0; k < 8; k++) {
+                    int i = (first + k) % 8;
+                    uint16_t d = field_get(&g_field, s->gm_x[npc] + g_ant_move_table[i].x, s->gm_y[npc] + g_ant_move_table[i].y);
+                    if (d < best) {
+                        best = d;
+                        dir = i;
+                    }
                 }
             }
-            if (target_cell.x == -1) {
-                //no leaf, choose random cell
-                do {
-                int n = rand() % 8;
-                Point random_offset = g_ant_move_table[n];
-                npc->target_angle = n * 45;
-                target_cell.x = npc->gm_x + random_offset.x;
-                target_cell.y = npc->gm_y + random_offset.y;
-                } 
-                while (g_map.matrix[target_cell.y][target_cell.x] == MAP_WALL || g_map.matrix[target_cell.y][target_cell.x] == MAP_ANTHILL);
+            if (dir == -1) {
+                //no leaf in reach, choose random cell
+                int open[8], open_num = 0;
+                for (int i = 0; i < 8; i++)
+                    if (!(blocked & MAP_NEIGHBOUR_BIT(g_ant_move_table[i].x, g_ant_move_table[i].y)))
+                        open[open_num++] = i;
+                //walled in, nowhere to go
+                if (open_num == 0) break;
+                dir = open[npc_rand(npc) % open_num];
             }
-            npc->gm_x = target_cell.x;
-            npc->gm_y = target_cell.y;
-            npc->steps_done = 0;
-
-            if ((npc->ant->angle > npc->target_angle && npc->ant->angle - npc->target_angle > 180) ||
-                    (npc->target_angle > npc->ant->angle && npc->target_angle - npc->ant->angle < 180)) npc->cw = 1;
-            else npc->cw = -1;
+            s->target_angle[npc] = dir * 45;
+            s->gm_x[npc] += g_ant_move_table[dir].x;
+            s->gm_y[npc] += g_ant_move_table[dir].y;
+            s->regrid[npc] = npc_grid_cell(s->gm_x[npc], s->gm_y[npc]) != s->grid_cell[npc];
+            s->steps_done[npc] = 0;
 
-            npc->state = ANT_STATE_TURN;
+            if ((s->angle[npc] > s->target_angle[npc] && s->angle[npc] - s->target_angle[npc] > 180) ||
+                    (s->target_angle[npc] > s->angle[npc] && s->target_angle[npc] - s->angle[npc] < 180)) s->cw[npc] = 1;
+            else s->cw[npc] = -1;
 
-            //TODO: may segfault on boundary of the map
+            s->state[npc] = ANT_STATE_TURN;
             break;
 
         case ANT_STATE_TURN:
 
-            if (emod(npc->ant->angle, 360) != npc->target_angle) {
-                npc->ant->angle = emod(npc->ant->angle + 5 * npc->cw, 360);
+            if (emod(s->angle[npc], 360) != s->target_angle[npc]) {
+                s->angle[npc] = emod(s->angle[npc] + 5 * s->cw[npc], 360);
             }
             else
-                npc->state = ANT_STATE_STEP;
+                s->state[npc] = ANT_STATE_STEP;
             break;
         case ANT_STATE_STEP:
-            if (npc->steps_done < ANT_STEP_LEN) {
-                npc->steps_done++;
-                float rad = (npc->ant->angle - 90) * M_PI / 180.0;
-                if (npc->ant->angle % 90 == 0) {
-                    npc->ant->x += cosf(rad);
-                    npc->ant->y += sinf(rad);
-                }
-                else {
-                    npc->ant->x += cosf(rad) * M_SQRT2;
-                    npc->ant->y += sinf(rad) * M_SQRT2;
-                }
+            if (s->steps_done[npc] < ANT_STEP_LEN) {
+                //npcs only walk straight or diagonally, a pixel along each axis per step,
+                //so they arrive exactly at the centre of the target cell
+                Point dir = g_ant_move_table[s->angle[npc] / 45];
+                s->steps_done[npc]++;
+                s->x[npc] += dir.x * POS_ONE;
+                s->y[npc] += dir.y * POS_ONE;
             }
             else {
-                //correction
-                npc->ant->x = npc->gm_x * CELL_SIZE + (float) CELL_SIZE / 2;
-                npc->ant->y = npc->gm_y * CELL_SIZE + (float) CELL_SIZE / 2;
-                int8_t *cell = &g_map.matrix[(int) npc->ant->y / CELL_SIZE][(int) npc->ant->x / CELL_SIZE];
-                if (*cell == MAP_FOOD) {
-                    remove_food(cell);
-                }
-                npc->state = ANT_STATE_PREPARE;
+                s->pickup[npc] = map_get(&g_map, s->gm_x[npc], s->gm_y[npc]) == MAP_FOOD;
+                s->state[npc] = ANT_STATE_PREPARE;
             }
             break;
     }
-    return interval;
 }
 
-Npc *create_npc(int gm_x, int gm_y) {
-    Npc *npc = malloc(sizeof(Npc));
-    if (npc == NULL) return NULL;
-    npc->ant = create_ant((gm_x + 0.5) * CELL_SIZE, (gm_y + 0.5) * CELL_SIZE);
-    if (npc->ant == NULL) {
-        free(npc);
-        SDL_Log("Warning: Could not allocate memory for an npc ant");
-        return NULL;
+void move_npc_chunks(void) {
+    size_t chunk;
+    while ((chunk = SDL_AtomicAdd(&g_sim_next_chunk, 1)) * SIM_CHUNK < g_npcs.num) {
+        size_t end = (chunk + 1) * SIM_CHUNK < g_npcs.num ? (chunk + 1) * SIM_CHUNK : g_npcs.num;
+        for (Npc npc = chunk * SIM_CHUNK; npc < end; npc++)
+            move_npc(npc);
     }
-    if (!push_npc(npc)) {
-        SDL_Log("Warning: could not push npc ant\n");
-        free(npc->ant);
-        free(npc);
-        return NULL;
+}
+
+int sim_worker(void *data) {
+    (void) data;
+    for (;;) {
+        SDL_SemWait(g_sim_start);
+        if (g_sim_quit) return 0;
+        move_npc_chunks();
+        SDL_SemPost(g_sim_done);
     }
-    npc->gm_x = gm_x;
-    npc->gm_y = gm_y;
-    npc->state = ANT_STATE_PREPARE;
-    SDL_AddTimer(ANT_MS_TO_MOVE, move_npc, (void *) npc);
-    return npc;
 }
 
-void create_food(void) {
-    SDL_Rect leaf_rect = { 
-        .w = g_leaf_texture.width,
-        .h = g_leaf_texture.height
-    };
-    Point point;
-    do {
-    point = find_random_free_spot_on_a_map();
-    leaf_rect.x = point.x * CELL_SIZE;
-    leaf_rect.y = point.y * CELL_SIZE;
-    } while (check_collision(leaf_rect, g_camera));
-
-    g_map.matrix[point.y][point.x] = MAP_FOOD;
+//without workers everything is simply done on the main thread
+void start_sim_workers(void) {
+    g_sim_start = SDL_CreateSemaphore(0);
+    g_sim_done = SDL_CreateSemaphore(0);
+    if (g_sim_start == NULL || g_sim_done == NULL) return;
+    int num = min(SDL_GetCPUCount() - 1, SIM_MAX_WORKERS);
+    for (int i = 0; i < num; i++) {
+        if ((g_sim_workers[i] = SDL_CreateThread(sim_worker, "sim_worker", NULL)) == NULL) {
+            SDL_Log("Warning: could not start simulation worker: %s", SDL_GetError());
+            break;
+        }
+        g_sim_workers_num++;
+    }
+}
+
+void stop_sim_workers(void) {
+    g_sim_quit = true;
+    for (int i = 0; i < g_sim_workers_num; i++)
+        SDL_SemPost(g_sim_start);
+    for (int i = 0; i < g_sim_workers_num; i++)
+        SDL_WaitThread(g_sim_workers[i], NULL);
+    g_sim_workers_num = 0;
+    SDL_DestroySemaphore(g_sim_start);
+    SDL_DestroySemaphore(g_sim_done);
+}
+
+//leaves reached during the tick are taken in npc order, so when several ants reach the same leaf
+//the first one gets it no matter how the npcs were split between the threads
+void collect_food(void) {
+    int8_t *pickup = g_npcs.pickup;
+    ptrdiff_t i;
+    size_t from = 0;
+    while ((i = scan_find_first(pickup + from, g_npcs.num - from, 1)) != -1) {
+        Npc npc = from + i;
+        pickup[npc] = 0;
+        if (map_get(&g_map, g_npcs.gm_x[npc], g_npcs.gm_y[npc]) == MAP_FOOD)
+            remove_food(g_npcs.gm_x[npc], g_npcs.gm_y[npc]);
+        from = npc + 1;
+    }
+}
+
+//move the npcs that crossed into another chunk to its list
+void regrid_npcs(void) {
+    int8_t *regrid = g_npcs.regrid;
+    ptrdiff_t i;
+    size_t from = 0;
+    while ((i = scan_find_first(regrid + from, g_npcs.num - from, 1)) != -1) {
+        Npc npc = from + i;
+        regrid[npc] = 0;
+        grid_unlink(npc);
+        grid_link(npc);
+        from = npc + 1;
+    }
+}
+
+size_t npcs_in_rect(int x0, int y0, int x1, int y1, Npc *out) {
+    x0 = max(x0, 0);
+    y0 = max(y0, 0);
+    x1 = min(x1, g_map.width);
+    y1 = min(y1, g_map.height);
+    size_t num = 0;
+    for (int cy = y0 / MAP_CHUNK_SIZE; cy * MAP_CHUNK_SIZE < y1; cy++)
+        for (int cx = x0 / MAP_CHUNK_SIZE; cx * MAP_CHUNK_SIZE < x1; cx++)
+            for (Npc npc = g_npc_grid[cy * g_map.chunks_w + cx]; npc != NPC_NONE; npc = g_npcs.grid_next[npc]) {
+                out[num] = npc;
+                num += g_npcs.gm_x[npc] >= x0 && g_npcs.gm_x[npc] < x1 && g_npcs.gm_y[npc] >= y0 && g_npcs.gm_y[npc] < y1;
+            }
+    return num;
+}
+
+size_t npcs_near(int gm_x, int gm_y, int radius, Npc *out) {
+    return npcs_in_rect(gm_x - radius, gm_y - radius, gm_x + radius + 1, gm_y + radius + 1, out);
+}
+
+//(re)build everything derived from the map and the leaves on it, once they are placed
+void index_world(void) {
+    free(g_npc_grid);
+    size_t cells = (size_t) g_map.chunks_w * g_map.chunks_h;
+    if (!build_field(&g_field, &g_map) || (g_npc_grid = malloc(cells * sizeof(Npc))) == NULL) {
+        SDL_Log("Error: could not allocate the distance field and the ant grid\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < cells; i++)
+        g_npc_grid[i] = NPC_NONE;
+    for (Npc npc = 0; npc < g_npcs.num; npc++)
+        grid_link(npc);
+}
+
+//advance the world by one step of ANT_MS_TO_MOVE
+void simulate_tick(Player *player) {
+    move_player(player);
+    //every npc sees the map as it was at the start of the tick
+    SDL_AtomicSet(&g_sim_next_chunk, 0);
+    int workers = g_npcs.num >= SIM_PARALLEL_MIN_NPCS ? g_sim_workers_num : 0;
+    for (int i = 0; i < workers; i++)
+        SDL_SemPost(g_sim_start);
+    move_npc_chunks();
+    for (int i = 0; i < workers; i++)
+        SDL_SemWait(g_sim_done);
+    collect_food();
+    regrid_npcs();
+}
+
+//advance the player and all npcs by as many ANT_MS_TO_MOVE steps as the clock has moved on since the last call,
+//after a stall (e.g. the window being dragged) at most SIM_MAX_TICKS are run and the rest of the lag is dropped
+void simulate(Player *player) {
+    Uint32 now = SDL_GetTicks();
+    for (int ticks = 0; now - g_sim_time >= ANT_MS_TO_MOVE; ticks++) {
+        if (ticks == SIM_MAX_TICKS) {
+            g_sim_time = now;
+            break;
+        }
+        g_sim_time += ANT_MS_TO_MOVE;
+        simulate_tick(player);
+    }
+    g_sim_alpha = (float) (now - g_sim_time) / ANT_MS_TO_MOVE;
+}
+
+static void init_npc(Npc npc, int gm_x, int gm_y) {
+    NpcStore *s = &g_npcs;
+    s->x[npc] = s->prev_x[npc] = (gm_x * CELL_SIZE + CELL_SIZE / 2) * POS_ONE;
+    s->y[npc] = s->prev_y[npc] = (gm_y * CELL_SIZE + CELL_SIZE / 2) * POS_ONE;
+    s->angle[npc] = 0;
+    s->state[npc] = ANT_STATE_PREPARE;
+    s->target_angle[npc] = 0;
+    s->cw[npc] = 0;
+    s->steps_done[npc] = 0;
+    s->gm_x[npc] = gm_x;
+    s->gm_y[npc] = gm_y;
+    //xorshift never leaves 0
+    s->seed[npc] = rng_next(&g_spawn_rng) | 1;
+    s->pickup[npc] = 0;
+    s->regrid[npc] = 0;
+    grid_link(npc);
+    s->frame[npc] = 0;
+    s->anim_time[npc] = SDL_GetTicks();
+    s->scale[npc] = rng_float(&g_looks_rng) + 0.75;
+#if DEBUGMODE
+    SDL_Log("Ant #%u created at x %d y %d\n", npc, s->x[npc] / POS_ONE, s->y[npc] / POS_ONE);
+#endif
+}
+
+size_t spawn_npcs(size_t count, int gm_x, int gm_y) {
+    NpcStore *s = &g_npcs;
+    if (s->num + count > s->capacity) {
+        //grow geometrically, or straight to the size needed for a big batch
+        size_t capacity = s->capacity * 2 > s->num + count ? s->capacity * 2 : s->num + count;
+        if (!reserve_npcs(capacity) && !reserve_npcs(s->num + count)) {
+            //take as many as there is room for
+            count = s->capacity - s->num;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        init_npc(s->num++, gm_x, gm_y);
+    return count;
+}
+
+//returns false if there is no free tile left for a leaf, they grow outside the camera while there is room
+bool create_food(void) {
+    //tiles whose leaf would overlap the camera, leaves are drawn from the top left corner of a tile
+    int x0 = floor_div(g_camera.x - g_leaf_texture.width, CELL_SIZE) + 1;
+    int y0 = floor_div(g_camera.y - g_leaf_texture.height, CELL_SIZE) + 1;
+    int x1 = floor_div(g_camera.x + g_camera.w - 1, CELL_SIZE) + 1;
+    int y1 = floor_div(g_camera.y + g_camera.h - 1, CELL_SIZE) + 1;
+    Point point = find_random_free_spot_outside(&g_food_rng, x0, y0, x1, y1);
+    //when zoomed out there may be no room outside the camera, then leaves grow in sight
+    if (point.x == -1)
+        point = find_random_free_spot_on_a_map(&g_food_rng);
+    if (point.x == -1) return false;
+
+    set_tile(point.x, point.y, MAP_FOOD);
+    field_add_food(&g_field, &g_map, point.x, point.y);
     g_world_food_count++;
+    return true;
 }
 
 //coordinates of the entrance (where the ants spawn)
 void init_anthill(Anthill *anthill) {
 
     anthill->level = 0;
-    for (int i = 0; i < g_map.height; i++) {
-        for (int j = 0; j < g_map.width; j++) {
-            if (g_map.matrix[i][j] == MAP_ANTHILL) {
+    //v2 maps store the anthill position, older ones are scanned
+    if (g_map.anthill_x != -1 && map_get(&g_map, g_map.anthill_x, g_map.anthill_y) == MAP_ANTHILL) {
+        anthill->gm_x = g_map.anthill_x + 1;
+        anthill->gm_y = g_map.anthill_y;
+        anthill->x = g_map.anthill_x * CELL_SIZE;
+        anthill->y = g_map.anthill_y * CELL_SIZE;
+        return;
+    }
+    //only chunk rows that have anthill tiles are scanned, the first tile found is the top left one
+    for (int cy = 0; cy < g_map.chunks_h; cy++) {
+        bool has_anthill = false;
+        for (int cx = 0; cx < g_map.chunks_w && !has_anthill; cx++)
+            has_anthill = map_chunk_count(&g_map, cx, cy, MAP_ANTHILL) > 0;
+        if (!has_anthill) continue;
+        for (int i = cy * MAP_CHUNK_SIZE; i < min((cy + 1) * MAP_CHUNK_SIZE, g_map.height); i++) {
+            ptrdiff_t j = scan_find_first(map_row(&g_map, i), g_map.width, MAP_ANTHILL);
+            if (j != -1) {
                 anthill->gm_x = j + 1;
                 anthill->gm_y = i;
                 anthill->x = (anthill->gm_x - 1) * CELL_SIZE;
@@ -585,66 +1416,163 @@ void init_anthill(Anthill *anthill) {
     exit(1);
 }
 
+void seed_rngs(uint64_t seed) {
+    g_seed = seed;
+    g_food_rng = rng_stream(seed, RNG_FOOD);
+    g_spawn_rng = rng_stream(seed, RNG_SPAWN);
+    g_looks_rng = rng_stream(seed, RNG_LOOKS);
+}
 
-Texture win(void) {
-Texture win_texture = load_text_texture("Congratulations! You won!");
-return win_texture;
+//load the map, find the anthill and put the leaves on it, exits if the map can not be loaded
+void load_level(char *map_path, Anthill *anthill) {
+    seed_rngs(g_seed);
+    if (!load_map_mode(map_path, MAP_LOAD_MAPPED_COPY)) {
+        SDL_Log("Could not load map\n");
+        exit(1);
+    }
+    else
+        SDL_Log("Map %dx%d loaded successfully!\n", g_map.width, g_map.height);
+    level_width = g_map.width * CELL_SIZE;
+    level_height = g_map.height * CELL_SIZE;
+    init_anthill(anthill);
+    init_tile_cache();
+    init_minimap();
+    //leaves placed in the map count too
+    int universal_food_count = g_map.height * g_map.width / TILES_PER_FOOD;
+    g_world_food_count = g_map.tile_counts[MAP_FOOD];
+    while(g_world_food_count < universal_food_count && create_food());
+    index_world();
+}
+
+//give the player the leaves collected since the last call and grow as many new ones, returns how many
+int take_collected_food(Player *player, Anthill *anthill) {
+    //a burst of pickups costs one HUD update
+    int collected = SDL_AtomicSet(&g_food_collected, 0);
+    if (collected > 0) {
+        //only friendly ants currently
+        player->food_count += collected;
+        update_food_count_text(player->food_count, g_levels_table[anthill->level]);
+        for (int i = 0; i < collected && create_food(); i++);
+    }
+    return collected;
+}
+
+//spend the player's leaves on the next level if there are enough, returns true when the last level is reached
+bool upgrade_anthill(Player *player, Anthill *anthill) {
+    if (player->food_count < g_levels_table[anthill->level] || anthill->level >= MAX_LEVEL)
+        return false;
+    player->food_count -= g_levels_table[anthill->level];
+    update_food_count_text(player->food_count, g_levels_table[anthill->level + 1]);
+    if (spawn_npcs(g_levels_table[anthill->level] / 2, anthill->gm_x, anthill->gm_y) < (size_t) g_levels_table[anthill->level] / 2)
+        SDL_Log("Warning: could not create NPC ant\n");
+    update_anthill_level_text(++anthill->level);
+    return anthill->level == MAX_LEVEL;
+}
+
+static bool player_walkable(int gm_x, int gm_y) {
+    int8_t tile = map_get(&g_map, gm_x, gm_y);
+    return tile != MAP_WALL && tile != MAP_ANTHILL;
+}
+
+//scripted player for headless runs: walks from tile centre to tile centre down the distance field to the
+//nearest leaf (it starts on the edge of the anthill, which is not in the field), target is the tile it is
+//walking to ({-1, -1} to start)
+void steer_player(Player *player, Point *target) {
+    int px = player->ant->x / POS_ONE, py = player->ant->y / POS_ONE;
+    int dx = target->x * CELL_SIZE + CELL_SIZE / 2 - px, dy = target->y * CELL_SIZE + CELL_SIZE / 2 - py;
+    if (target->x == -1 || (abs(dx) <= ANT_VEL_MAX && abs(dy) <= ANT_VEL_MAX)) {
+        int gm_x = px / CELL_SIZE, gm_y = py / CELL_SIZE;
+        uint16_t best = field_get(&g_field, gm_x, gm_y);
+        *target = (Point) {gm_x, gm_y};
+        for (int dir = 0; dir < 8; dir++) {
+            int x = gm_x + g_ant_move_table[dir].x, y = gm_y + g_ant_move_table[dir].y;
+            bool corner_x = !player_walkable(x, gm_y), corner_y = !player_walkable(gm_x, y);
+            if (!player_walkable(x, y) || field_get(&g_field, x, y) >= best || (dir % 2 == 1 && corner_x && corner_y))
+                continue;
+            best = field_get(&g_field, x, y);
+            *target = (Point) {x, y};
+            //a diagonal step past a wall corner would run into it, so the free side is taken first
+            if (dir % 2 == 1 && corner_x)
+                target->x = gm_x;
+            else if (dir % 2 == 1 && corner_y)
+                target->y = gm_y;
+        }
+        dx = target->x * CELL_SIZE + CELL_SIZE / 2 - px;
+        dy = target->y * CELL_SIZE + CELL_SIZE / 2 - py;
+    }
+    //head in the one of the 8 directions that closes in on both axes, an axis within a step counts as reached,
+    //so the heading comes from the integer tables and the run does not depend on the libm it was built with
+    int sx = dx > ANT_VEL_MAX ? 1 : (dx < -ANT_VEL_MAX ? -1 : 0);
+    int sy = dy > ANT_VEL_MAX ? 1 : (dy < -ANT_VEL_MAX ? -1 : 0);
+    player->turn_vel = 0;
+    player->vel = 0;
+    for (int dir = 0; dir < 8; dir++) {
+        if (g_ant_move_table[dir].x == sx && g_ant_move_table[dir].y == sy) {
+            player->vel = ANT_VEL_MAX;
+            player->ant->angle = dir * 45;
+        }
+    }
 }
 
 void render_game_objects(Player *player, Anthill *anthill) {
         SDL_SetRenderDrawColor(g_renderer, 0x00, 0x90, 0x00, 0xFF);
         SDL_RenderClear(g_renderer);
+        SDL_RenderSetScale(g_renderer, g_zoom, g_zoom);
 
-        //render background texture tiles (only those that are on the screen)
-        for (int y = 0; y < level_height; y += g_background_texture.height) {
-            for (int x = 0; x < level_width; x += g_background_texture.width) {
-                SDL_Rect coords = {
-                    x,
-                    y,
-                    g_background_texture.width,
-                    g_background_texture.height
-                };
-                if (check_collision(coords, g_camera)) {
-                    render_texture(g_background_texture, x - g_camera.x, y - g_camera.y);
-                }
-            }
-        }
+        //grass and walls of the chunks on the screen, or everything but the ants from afar
+        bool lod = use_minimap();
+        if (lod)
+            render_minimap();
+        else
+            render_static_tiles();
 
         render_player_anim(player);
 
-        //render ants which are on the screen
-        for (size_t i = 0; i < g_npc_sp; i++) {
-            SDL_Rect coords = {
-                g_npc_stack[i]->ant->x,
-                g_npc_stack[i]->ant->y,
-                g_ant_texture.width / ANT_FRAMES_NUM,
-                g_ant_texture.height
-            };
-            if (check_collision(coords, g_camera)) {
-                render_ant_anim(g_npc_stack[i]->ant);
+        //render ants which are on the screen, only the ants in the grid cells around the camera are looked at;
+        //an ant is up to a tile away from the tile it is heading to and drawn centred on its position at under
+        //twice the frame size, so the frame's width plus height covers half of any sprite
+        int margin = 1 + (g_antframes[0].w + g_antframes[0].h) / CELL_SIZE + 1;
+        size_t candidates = npcs_in_rect(g_camera.x / CELL_SIZE - margin, g_camera.y / CELL_SIZE - margin,
+                (g_camera.x + g_camera.w) / CELL_SIZE + margin, (g_camera.y + g_camera.h) / CELL_SIZE + margin, g_npcs.visible);
+        if (lod && g_ant_dots_capacity < candidates) {
+            SDL_Rect *dots = realloc(g_ant_dots, candidates * sizeof(SDL_Rect));
+            if (dots != NULL) {
+                g_ant_dots = dots;
+                g_ant_dots_capacity = candidates;
             }
         }
+        size_t dots_num = 0;
+        int dot = ceilf(ANT_DOT_PX / g_zoom);
+        for (size_t i = 0; i < candidates; i++) {
+            Npc npc = g_npcs.visible[i];
+            int32_t x = lerp_pos(g_npcs.prev_x[npc], g_npcs.x[npc]), y = lerp_pos(g_npcs.prev_y[npc], g_npcs.y[npc]);
+            int w = g_antframes[0].w * g_npcs.scale[npc], h = g_antframes[0].h * g_npcs.scale[npc];
+            SDL_Rect coords = {x / POS_ONE - w / 2, y / POS_ONE - h / 2, w, h};
+            if (!check_collision(coords, g_camera))
+                continue;
+            if (!lod)
+                render_npc_anim(npc, x, y);
+            else if (dots_num < g_ant_dots_capacity)
+                g_ant_dots[dots_num++] = (SDL_Rect) {x / POS_ONE - g_camera.x - dot / 2, y / POS_ONE - g_camera.y - dot / 2, dot, dot};
+        }
+        flush_ants();
+        if (dots_num > 0) {
+            SDL_SetRenderDrawColor(g_renderer, 0x30, 0x18, 0x08, 0xFF);
+            SDL_RenderFillRects(g_renderer, g_ant_dots, dots_num);
+        }
 
-
-        for (int i = g_camera.y / CELL_SIZE; i < (g_camera.y + g_camera.h + CELL_SIZE) / CELL_SIZE && i < g_map.height; i++) {
-            for (int j = g_camera.x / CELL_SIZE; j < (g_camera.x + g_camera.w + CELL_SIZE) / CELL_SIZE && j < g_map.width; j++) {
-                if (g_map.matrix[i][j] == MAP_WALL) {
-                    SDL_Rect coords = {
-                        j * CELL_SIZE - g_camera.x,
-                        i * CELL_SIZE - g_camera.y,
-                        CELL_SIZE,
-                        CELL_SIZE
-                    };
-                    //TODO: compare SDL_RenderFillRect and SDL_FillRect speed
-                    SDL_RenderFillRect(g_renderer, &coords);
-                }
-                else if (g_map.matrix[i][j] == MAP_FOOD) {
-                    render_texture(g_leaf_texture, j * CELL_SIZE - g_camera.x, i * CELL_SIZE - g_camera.y);
-                }
+        //visible leaves (the minimap has them already), they are found in the bit planes so that runs of up to
+        //64 tiles without one are skipped at once
+        int first_i = max(g_camera.y / CELL_SIZE, 0), last_i = min((g_camera.y + g_camera.h + CELL_SIZE) / CELL_SIZE, g_map.height);
+        int first_j = max(g_camera.x / CELL_SIZE, 0), last_j = min((g_camera.x + g_camera.w + CELL_SIZE) / CELL_SIZE, g_map.width);
+        for (int i = first_i; i < last_i && !lod; i++) {
+            for (int j = map_plane_next(&g_map, MAP_FOOD, i, first_j, last_j); j != -1; j = map_plane_next(&g_map, MAP_FOOD, i, j + 1, last_j)) {
+                render_texture(g_leaf_texture, j * CELL_SIZE - g_camera.x, i * CELL_SIZE - g_camera.y);
             }
         }
         //render anthill
         render_texture(g_anthill_texture, anthill->x - g_camera.x, anthill->y - g_camera.y);
+        SDL_RenderSetScale(g_renderer, 1, 1);
 
         //draw HUD
         //TODO: maybe draw a single picture (png) instead of many rects (also would be more pretty if drawn nice)
@@ -652,51 +1580,48 @@ void render_game_objects(Player *player, Anthill *anthill) {
         SDL_Rect hud = {0, screen_height * 14 / 15, screen_width, screen_height / 15};
         SDL_RenderFillRect(g_renderer, &hud);
         SDL_SetRenderDrawColor(g_renderer, 0x90, 0xCC, 0x90, 0xFF);
-        SDL_Rect space_for_hud1 = {screen_width / 20, screen_height * 44 / 45 - g_food_count_texture.height / 2,
+        SDL_Rect space_for_hud1 = {screen_width / 20, screen_height * 44 / 45 - g_glyphs.height / 2,
             screen_width * 19/ 20, g_leaf_texture.height};
         SDL_RenderFillRect(g_renderer, &space_for_hud1);
         render_texture(g_leaf_texture, screen_width / 20, screen_height * 34 / 35 - g_leaf_texture.height / 2);
-        render_texture(g_food_count_texture, screen_width / 10, screen_height * 34 / 35 - g_food_count_texture.height / 2 - 5);
+        draw_text(g_food_count_text, screen_width / 10, screen_height * 34 / 35 - g_glyphs.height / 2 - 5);
 
         render_texture(g_anthill_icon_texture, screen_width * 4 / 5, screen_height * 34 / 35 - g_anthill_icon_texture.height / 2);
-        render_texture(g_anthill_level_texture, screen_width * 4 / 5 + g_anthill_icon_texture.width, screen_height * 34 / 35 - g_food_count_texture.height / 2 - 5);
+        draw_text(g_anthill_level_text, screen_width * 4 / 5 + g_anthill_icon_texture.width, screen_height * 34 / 35 - g_glyphs.height / 2 - 5);
 
 
 #if TUTORIAL
         static int last_food_count;
         if (g_tutorial != TUTORIAL_DONE) {
-            render_texture(g_tutorial_prompt, screen_width / 2 - g_tutorial_prompt.width / 2, 0);
+            draw_text(g_tutorial_prompt, screen_width / 2 - text_width(g_tutorial_prompt) / 2, 0);
             switch (g_tutorial) {
                 case TUTORIAL_LEAVES:
                     if (player->food_count >= 10) {
                         g_tutorial++;
-                        SDL_DestroyTexture(g_tutorial_prompt.texture_proper);
 #if ANDROID_BUILD
-                        g_tutorial_prompt = load_text_texture("Enter your anthill and tap on it to upgrade");
+                        g_tutorial_prompt = "Enter your anthill and tap on it to upgrade";
 #else
-                        g_tutorial_prompt = load_text_texture("Enter your anthill and press Space to upgrade");
+                        g_tutorial_prompt = "Enter your anthill and press Space to upgrade";
 #endif
                     }
                     break;
                 case TUTORIAL_UPGRADE:
                     if (anthill->level > 0) {
                         g_tutorial++;
-                        SDL_DestroyTexture(g_tutorial_prompt.texture_proper);
-                        g_tutorial_prompt = load_text_texture("Now reach level "STR(MAX_LEVEL)"!");
+                        g_tutorial_prompt = "Now reach level "STR(MAX_LEVEL)"!";
                         last_food_count = player->food_count;
                     };
                     break;
                 case TUTORIAL_TEN:
                     if (player->food_count > last_food_count) {
                         g_tutorial++;
-                        SDL_DestroyTexture(g_tutorial_prompt.texture_proper);
-                        g_tutorial_prompt.texture_proper = NULL;
+                        g_tutorial_prompt = NULL;
                     }
                     break;
             }
         }
 #endif
-        
+        flush_text();
 }
 
 void toggle_fullscreen(void) {
@@ -713,7 +1638,7 @@ bool is_in_rect(SDL_Rect *rect, int x, int y) {
 //menu returns map_path
 char *menu(void) {
     SDL_SetRenderDrawColor(g_renderer, 0x00, 0x90, 0, 0xFF);
-    Texture choose_map_prompt = load_text_texture("Choose a map");
+    const char *choose_map_prompt = "Choose a map";
     Texture map1thumb_texture = load_texture(ASSETS_PREFIX"map1thumb.png");
     Texture map2thumb_texture = load_texture(ASSETS_PREFIX"map2thumb.png");
     bool quit = false;
@@ -741,8 +1666,9 @@ char *menu(void) {
                     break;
                 case SDL_WINDOWEVENT:
                     if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
-                        g_camera.w = screen_width = event.window.data1;
-                        g_camera.h = screen_height = event.window.data2;
+                        screen_width = event.window.data1;
+                        screen_height = event.window.data2;
+                        set_zoom(g_zoom);
                         thumb_scale = (float) screen_width / (1920 * 2);
 #if ANDROID_BUILD
                         SDL_SetWindowFullscreen(g_window, SDL_WINDOW_FULLSCREEN);
@@ -791,42 +1717,91 @@ char *menu(void) {
             }
         }
 
-        render_texture(choose_map_prompt, screen_width / 2 - choose_map_prompt.width / 2, 0);
+        draw_text(choose_map_prompt, screen_width / 2 - text_width(choose_map_prompt) / 2, 0);
+        flush_text();
         render_texture_scaled(map1thumb_texture, map1thumb.x, map1thumb.y, thumb_scale);
         render_texture_scaled(map2thumb_texture, map2thumb.x, map2thumb.y, thumb_scale);
 
-        SDL_RenderPresent(g_renderer);
+        present_frame();
     }
-    SDL_DestroyTexture(choose_map_prompt.texture_proper);
     SDL_DestroyTexture(map1thumb_texture.texture_proper);
     SDL_DestroyTexture(map2thumb_texture.texture_proper);
     return map_path;
 }
 
-void destroy_npc(Npc *npc) {
-    SDL_RemoveTimer(npc->timer_id);
-    free(npc->ant);
-    free(npc);
-}
+//////////////// MAIN ///////////////////////////////////////////////////////////
+
 
-void destroy_map(Map *map) {
-    for (size_t i = 0; i < map->height; i++) {
-        free(map->matrix[i]);
+//run the game without a window or any SDL video for the given number of ticks, as fast as they can be
+//simulated; the scripted player upgrades the anthill as soon as it has the leaves, without walking back to it
+int run_headless(char *map_path, long ticks) {
+    scc(SDL_Init(SDL_INIT_TIMER), "Could not initialize SDL");
+    init_sim();
+    Anthill anthill = {0, 0, -1, 0, 0};
+    load_level(map_path, &anthill);
+    Player player = {0};
+    player.ant = create_ant((anthill.gm_x + 0.5) * CELL_SIZE, anthill.gm_y * CELL_SIZE);
+    scp(player.ant, "Could not allocate memory for player ant");
+
+    Point target = {-1, -1};
+    long collected = 0, won_tick = -1;
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (long tick = 0; tick < ticks; tick++) {
+        steer_player(&player, &target);
+        simulate_tick(&player);
+        collected += take_collected_food(&player, &anthill);
+        if (upgrade_anthill(&player, &anthill))
+            won_tick = tick + 1;
     }
-    free(map->matrix);
+    double seconds = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    printf("map %dx%d, seed %llu, %d sim workers\n", g_map.width, g_map.height, (unsigned long long) g_seed, g_sim_workers_num);
+    printf("%-16s %12ld (%.1f s of game time)\n", "ticks", ticks, ticks * ANT_MS_TO_MOVE / 1000.0);
+    printf("%-16s %12.3f\n", "seconds", seconds);
+    printf("%-16s %12.0f\n", "ticks/s", ticks / seconds);
+    printf("%-16s %12zu\n", "npcs", g_npcs.num);
+    printf("%-16s %12ld\n", "leaves taken", collected);
+    printf("%-16s %12d\n", "leaves on map", g_map.tile_counts[MAP_FOOD]);
+    printf("%-16s %9d/%d", "anthill level", anthill.level, MAX_LEVEL);
+    if (won_tick != -1)
+        printf(" (won at tick %ld)", won_tick);
+    printf("\n");
+
+    stop_sim_workers();
+    free(player.ant);
+    SDL_Quit();
+    return 0;
 }
 
-//////////////// MAIN ///////////////////////////////////////////////////////////
-
-
 int main(int argc, char *argv[]) {
-    srand(time(NULL));
     char *map_path;
+    //cants [--seed <seed>] [--no-vsync] [--headless <ticks>] [map]
+    int arg = 1;
+    g_seed = time(NULL);
+    for (;;) {
+        if (argc > arg + 1 && strcmp(argv[arg], "--seed") == 0) {
+            g_seed = strtoull(argv[arg + 1], NULL, 0);
+            arg += 2;
+        } else if (argc > arg && strcmp(argv[arg], "--no-vsync") == 0) {
+            g_vsync = false;
+            arg++;
+        } else {
+            break;
+        }
+    }
+    SDL_Log("Seed %llu\n", (unsigned long long) g_seed);
+    if (argc > arg && strcmp(argv[arg], "--headless") == 0) {
+        if (argc != arg + 3 || atol(argv[arg + 1]) <= 0) {
+            fprintf(stderr, "Usage: %s [--seed <seed>] --headless <ticks> <map>\n", argv[0]);
+            return 1;
+        }
+        return run_headless(argv[arg + 2], atol(argv[arg + 1]));
+    }
     init();
     load_media();
 
-    if (argc > 1)
-        map_path = argv[1];
+    if (argc > arg)
+        map_path = argv[arg];
     else {
         map_path = menu();
 
@@ -835,26 +1810,14 @@ int main(int argc, char *argv[]) {
             return 0;
         }
     }
-    if (!load_map(map_path)) {
-        SDL_Log("Could not load map\n");
-        exit(1);
-    }
-    else
-        SDL_Log("Map %dx%d loaded successfully!\n", g_map.width, g_map.height);
-
-    
-    level_width = g_map.width * CELL_SIZE;
-    level_height = g_map.height * CELL_SIZE;
-
     Anthill anthill = {0, 0, -1, 0, 0};
-    init_anthill(&anthill);
+    load_level(map_path, &anthill);
+    set_zoom(g_zoom);
 
 
     bool quit = false;
     bool reset = true;
 
-    g_eventstart = SDL_RegisterEvents(1);
-
     SDL_Event event;
 
     Player player = {0};
@@ -870,19 +1833,11 @@ int main(int argc, char *argv[]) {
     player.width = g_ant_texture.width / ANT_FRAMES_NUM;
     player.height = g_ant_texture.height;
 
-    {
-        int universal_food_count = g_map.height * g_map.width / TILES_PER_FOOD;
-        while(g_world_food_count < universal_food_count) {
-            create_food();
-        }
-    }
-
-    //call move_player each ANT_MS_TO_MOVE sec
-    SDL_AddTimer(ANT_MS_TO_MOVE, move_player, (void *) &player);
-
     while (reset) {
         reset = false;
+        g_sim_time = SDL_GetTicks();
         while(!(quit || reset)) {
+            simulate(&player);
             set_camera(&player);
             while(SDL_PollEvent(&event) != 0) {
                 switch (event.type) {
@@ -890,22 +1845,11 @@ int main(int argc, char *argv[]) {
                     case SDL_FINGERDOWN:;
                         int x = event.tfinger.x * screen_width, y = event.tfinger.y * screen_height;
 
-                        if (anthill.x <= x + g_camera.x && x + g_camera.x <= anthill.x + g_anthill_texture.width &&
-                            anthill.y <= y + g_camera.y && y + g_camera.y <= anthill.y + g_anthill_texture.height) {
+                        if (anthill.x <= x / g_zoom + g_camera.x && x / g_zoom + g_camera.x <= anthill.x + g_anthill_texture.width &&
+                            anthill.y <= y / g_zoom + g_camera.y && y / g_zoom + g_camera.y <= anthill.y + g_anthill_texture.height) {
                             //tapped on the anthill
-                            if (player.in_anthill && player.food_count >= g_levels_table[anthill.level] && anthill.level < MAX_LEVEL) {
-                                player.food_count -= g_levels_table[anthill.level];
-                                update_food_count_texture(player.food_count, g_levels_table[anthill.level + 1]);
-
-                                for (int i = 0; i < g_levels_table[anthill.level] / 2; i++)
-                                    if (create_npc(anthill.gm_x, anthill.gm_y) == NULL)
-                                        SDL_Log("Warning: could not create NPC ant\n");
-
-                                update_anthill_level_texture(++anthill.level);
-                                if (anthill.level == MAX_LEVEL) {
-                                    goto win;
-                                }
-                            }
+                            if (player.in_anthill && upgrade_anthill(&player, &anthill))
+                                goto win;
                         }
                         else if (event.tfinger.x <= 1.0 / 3) {
                             player.turn_vel = -ANT_TURN_DEGREES;
@@ -940,31 +1884,28 @@ int main(int argc, char *argv[]) {
 #if DEBUGMODE
                         //cheats for developers
                         case SDL_SCANCODE_LCTRL:
-                            if (create_npc(anthill.gm_x, anthill.gm_y) == NULL)
+                            if (spawn_npcs(1, anthill.gm_x, anthill.gm_y) == 0)
                                 SDL_Log("Warning: Could not allocate memory for an npc ant");
                             break;
                         case SDL_SCANCODE_RCTRL:
                             player.food_count++;
-                            update_food_count_texture(player.food_count, g_levels_table[anthill.level]);
+                            update_food_count_text(player.food_count, g_levels_table[anthill.level]);
                             break;
 #endif
                         case SDL_SCANCODE_SPACE:
-                            //upgrade if inside (TODO: copied to android btw which is a problem)
-                            if (player.in_anthill && player.food_count >= g_levels_table[anthill.level] && anthill.level < MAX_LEVEL) {
-                                player.food_count -= g_levels_table[anthill.level];
-                                update_food_count_texture(player.food_count, g_levels_table[anthill.level + 1]);
-                                for (int i = 0; i < g_levels_table[anthill.level] / 2; i++)
-                                    if (create_npc(anthill.gm_x, anthill.gm_y) == NULL)
-                                        SDL_Log("Warning: could not create NPC ant\n");
-                                update_anthill_level_texture(++anthill.level);
-                                if (anthill.level == MAX_LEVEL) {
-                                    goto win;
-                                }
-                            }
+                            //upgrade if inside
+                            if (player.in_anthill && upgrade_anthill(&player, &anthill))
+                                goto win;
                             break;
                         case SDL_SCANCODE_F11:
                             toggle_fullscreen();
                             break;
+                        case SDL_SCANCODE_EQUALS:
+                            set_zoom(g_zoom * ZOOM_STEP);
+                            break;
+                        case SDL_SCANCODE_MINUS:
+                            set_zoom(g_zoom / ZOOM_STEP);
+                            break;
                         case SDL_SCANCODE_ESCAPE:
                         case SDL_SCANCODE_AC_BACK:
                             reset = true;
@@ -1003,10 +1944,19 @@ int main(int argc, char *argv[]) {
                         }
                         break;
 #endif
+                    case SDL_MOUSEWHEEL:
+                        set_zoom(g_zoom * powf(ZOOM_STEP, event.wheel.y));
+                        break;
+                    case SDL_RENDER_TARGETS_RESET:
+                    case SDL_RENDER_DEVICE_RESET:
+                        //the cached chunks went with the render targets
+                        reset_tile_cache(event.type == SDL_RENDER_DEVICE_RESET);
+                        break;
                     case SDL_WINDOWEVENT:
                           if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
-                            g_camera.w = screen_width = event.window.data1;
-                            g_camera.h = screen_height = event.window.data2;
+                            screen_width = event.window.data1;
+                            screen_height = event.window.data2;
+                            set_zoom(g_zoom);
 #if ANDROID_BUILD
                             SDL_SetWindowFullscreen(g_window, SDL_WINDOW_FULLSCREEN);
 #endif
@@ -1015,40 +1965,25 @@ int main(int argc, char *argv[]) {
                     case SDL_QUIT:
                         quit = true;
                         break;
-                    case SDL_USEREVENT:
-                        //only friendly ants currently
-                        player.food_count++;
-                        update_food_count_texture(player.food_count, g_levels_table[anthill.level]);
-                        create_food();
-                        break;
                 }
             }
+            take_collected_food(&player, &anthill);
             render_game_objects(&player, &anthill);
-            SDL_RenderPresent(g_renderer);
+            present_frame();
         }
 
         if (reset) {
             player.vel = 0;
             player.turn_vel = 0;
             if ((map_path = menu()) != NULL) {
-                for (size_t i = 0; i < g_npc_sp; i++) {
-                    destroy_npc(g_npc_stack[i]);
-                }
-                g_npc_sp = 0;
+                clear_npcs();
+                destroy_field(&g_field);
                 destroy_map(&g_map);
-                load_map(map_path);
-                level_width = g_map.width * CELL_SIZE;
-                level_height = g_map.height * CELL_SIZE;
-                init_anthill(&anthill);
+                load_level(map_path, &anthill);
+                set_zoom(g_zoom);
                 player.ant->angle = 0;
-                player.ant->x = PLAYER_SPAWN_X;
-                player.ant->y = PLAYER_SPAWN_Y;
-                init_anthill(&anthill);
-                int universal_food_count = g_map.height * g_map.width / TILES_PER_FOOD;
-                g_world_food_count = 0;
-                while(g_world_food_count < universal_food_count) {
-                    create_food();
-                }
+                player.ant->x = player.ant->prev_x = PLAYER_SPAWN_X * POS_ONE;
+                player.ant->y = player.ant->prev_y = PLAYER_SPAWN_Y * POS_ONE;
 
             }
         }
@@ -1058,18 +1993,28 @@ int main(int argc, char *argv[]) {
 	return 0;
 
 win:;
-    Texture win_texture = win();
+    const char *win_text = "Congratulations! You won!";
+    //the whole colony is shown
+    set_zoom(0);
+    g_sim_time = SDL_GetTicks();
     while(!quit) {
+            simulate(&player);
+            set_camera(&player);
             while(SDL_PollEvent(&event) != 0) {
                 switch (event.type) {
                     case SDL_QUIT:
                         quit = true;
                         break;
+                case SDL_RENDER_TARGETS_RESET:
+                case SDL_RENDER_DEVICE_RESET:
+                    reset_tile_cache(event.type == SDL_RENDER_DEVICE_RESET);
+                    break;
                 //partially copypasted from main event loop which is a problem, will find a fix later
                 case SDL_WINDOWEVENT:
                       if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
-                        g_camera.w = screen_width = event.window.data1;
-                        g_camera.h = screen_height = event.window.data2;
+                        screen_width = event.window.data1;
+                        screen_height = event.window.data2;
+                        set_zoom(g_zoom);
 #if ANDROID_BUILD
                         SDL_SetWindowFullscreen(g_window, SDL_WINDOW_FULLSCREEN);
 #endif
@@ -1079,34 +2024,48 @@ win:;
             }
 
         render_game_objects(&player, &anthill);
-        render_texture(win_texture, screen_width / 2 - win_texture.width / 2, screen_height / 2 - win_texture.height / 2);
-        SDL_RenderPresent(g_renderer);
+        draw_text(win_text, screen_width / 2 - text_width(win_text) / 2, screen_height / 2 - g_glyphs.height / 2);
+        flush_text();
+        present_frame();
     }
     closesdl();
     return 0;
 }
 
-#define ANT_STACK_INIT_SIZE 10
-Npc** init_npc_stack(void) {
-    return malloc(ANT_STACK_INIT_SIZE * sizeof(Npc *));
+//columns are padded to NPC_COLUMN_ALIGN bytes inside the pool, so each one is aligned for its type
+#define NPC_COLUMN_ALIGN 16
+static size_t npc_column_size(size_t capacity, size_t element_size) {
+    return (capacity * element_size + NPC_COLUMN_ALIGN - 1) / NPC_COLUMN_ALIGN * NPC_COLUMN_ALIGN;
 }
 
-bool push_npc(Npc *npc) {
-    static size_t stack_size = ANT_STACK_INIT_SIZE;
-    if (g_npc_sp < stack_size) {
-        g_npc_stack[g_npc_sp++] = npc;
-    }
-    else {
-        if ((g_npc_stack = realloc((void *) g_npc_stack, stack_size * 2 * sizeof(Ant *))) == NULL) {
-            return false;
-        }
-        stack_size *= 2;
-        g_npc_stack[g_npc_sp++] = npc;
-
+//a bigger pool is allocated and the columns are moved over, the store is left as it was on failure
+bool reserve_npcs(size_t capacity) {
+    NpcStore *s = &g_npcs;
+    if (capacity <= s->capacity) return true;
+    size_t pool_size = 0;
+#define COLUMN_SIZE(column) pool_size += npc_column_size(capacity, sizeof(*s->column));
+    NPC_COLUMNS(COLUMN_SIZE)
+#undef COLUMN_SIZE
+    char *pool = malloc(pool_size);
+    if (pool == NULL) return false;
+    char *at = pool;
+#define MOVE_COLUMN(column) {                                                 \
+        if (s->num > 0) memcpy(at, s->column, s->num * sizeof(*s->column));   \
+        s->column = (void *) at;                                              \
+        at += npc_column_size(capacity, sizeof(*s->column));                  \
     }
+    NPC_COLUMNS(MOVE_COLUMN)
+#undef MOVE_COLUMN
+    free(s->pool);
+    s->pool = pool;
+    s->capacity = capacity;
     return true;
 }
 
+void clear_npcs(void) {
+    g_npcs.num = 0;
+}
+
 bool check_collision(SDL_Rect a, SDL_Rect b) {
     if(a.y + a.h <= b.y  ||
         a.y >= b.y + b.h ||
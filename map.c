@@ -2,83 +2,759 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <assert.h>
 #include <ctype.h>
 #include <string.h>
 #include "map.h"
+#include "scan.h"
+#if MMAP_MAPS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 Map g_map = {0};
 
-bool load_map(char *path) {
+#define SIGNATURE_LEN (sizeof CANTS_MAP_SIGNATURE - 1)
+//v1: signature, width and height bytes
+#define MAP_V1_HEADER_SIZE (SIGNATURE_LEN + 2)
+//v2: signature, a zero byte (a v1 width is never 0), version, encoding, a reserved byte,
+//width, height, anthill x and y, checksum, size of the tile data (all 32-bit little endian)
+//and padding up to MAP_V2_HEADER_SIZE
+#define MAP_V2_HEADER_SIZE 40
+
+typedef struct {
+    uint8_t version;
+    uint8_t encoding;
+    uint32_t width;
+    uint32_t height;
+    int32_t anthill_x;
+    int32_t anthill_y;
+    uint32_t checksum;
+    uint32_t data_size;
+} MapHeader;
+
+static uint32_t read_le32(const uint8_t *data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static void write_le32(uint8_t *data, uint32_t value) {
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+//parse the header at the beginning of a map file, returns the offset of the tiles or 0
+//size may be less than the whole header, then only the version is checked and the
+//needed size is put into *needed
+static size_t parse_header(const uint8_t *data, size_t size, MapHeader *header, size_t *needed) {
+    *needed = MAP_V1_HEADER_SIZE;
+    if (size < MAP_V1_HEADER_SIZE) {
+        fprintf(stderr, "Failed reading from file.\n");
+        return 0;
+    }
+    if (memcmp(data, CANTS_MAP_SIGNATURE, SIGNATURE_LEN) != 0) {
+        fprintf(stderr, "Given file is not a cants map.\n");
+        return 0;
+    }
+    if (data[SIGNATURE_LEN] != 0) {
+        header->version = 1;
+        header->encoding = MAP_ENCODING_RAW;
+        header->width = data[SIGNATURE_LEN];
+        header->height = data[SIGNATURE_LEN + 1];
+        header->anthill_x = header->anthill_y = -1;
+        header->checksum = 0;
+        header->data_size = header->width * header->height;
+        return MAP_V1_HEADER_SIZE;
+    }
+
+    *needed = MAP_V2_HEADER_SIZE;
+    if (size < MAP_V2_HEADER_SIZE) return 0;
+    header->version = data[SIGNATURE_LEN + 1];
+    header->encoding = data[SIGNATURE_LEN + 2];
+    if (header->version != MAP_VERSION) {
+        fprintf(stderr, "Unsupported map version %d.\n", header->version);
+        return 0;
+    }
+    if (header->encoding != MAP_ENCODING_RAW && header->encoding != MAP_ENCODING_RLE) {
+        fprintf(stderr, "Unsupported map encoding %d.\n", header->encoding);
+        return 0;
+    }
+    const uint8_t *fields = data + SIGNATURE_LEN + 4;
+    header->width = read_le32(fields);
+    header->height = read_le32(fields + 4);
+    header->anthill_x = read_le32(fields + 8);
+    header->anthill_y = read_le32(fields + 12);
+    header->checksum = read_le32(fields + 16);
+    header->data_size = read_le32(fields + 20);
+    if (header->width == 0 || header->height == 0 ||
+            header->width > MAP_MAX_SIDE || header->height > MAP_MAX_SIDE ||
+            (uint64_t) header->width * header->height > MAP_MAX_TILES) {
+        fprintf(stderr, "Map dimensions %ux%u are not supported.\n", header->width, header->height);
+        return 0;
+    }
+    if (header->encoding == MAP_ENCODING_RAW && header->data_size != header->width * header->height) {
+        fprintf(stderr, "Wrong size of the tile data.\n");
+        return 0;
+    }
+    return MAP_V2_HEADER_SIZE;
+}
+
+static void apply_header(const MapHeader *header) {
+    g_map.width = header->width;
+    g_map.height = header->height;
+    g_map.anthill_x = header->anthill_x;
+    g_map.anthill_y = header->anthill_y;
+}
+
+//Adler-32 of the tiles in row-major order
+uint32_t map_checksum(const Map *map) {
+    //the largest number of bytes before the sums have to be reduced (as in zlib)
+    const size_t nmax = 5552;
+    uint32_t a = 1, b = 0;
+    for (int i = 0; i < map->height; i++) {
+        const uint8_t *row = (const uint8_t *) map_row(map, i);
+        size_t left = map->width;
+        while (left > 0) {
+            size_t n = left < nmax ? left : nmax;
+            left -= n;
+            while (n--) {
+                a += *row++;
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+    }
+    return b << 16 | a;
+}
+
+#if MMAP_MAPS
+//map the whole file, returns false if the file cannot be mapped (e.g. it is inside an apk)
+static bool mmap_file(char *path, void **mapping, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return false;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    //the tiles are only ever read from the mapping
+    *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (*mapping == MAP_FAILED) return false;
+    *size = st.st_size;
+    return true;
+}
+#endif
+
+//run-length encoded tiles are a sequence of runs, each is a tile byte followed by the run
+//length as a LEB128 varint (7 bits per byte, the high bit is set on all but the last byte)
+//the decoder keeps its state between blocks, so the data can be fed in any pieces
+//and it expects zeroed (map_alloc'd) output, runs continue from the end of a row to the next one
+typedef struct {
+    int8_t *out;
+    size_t left; //tiles not decoded yet
+    int32_t width;
+    int32_t stride;
+    int32_t x; //column of out
+    int8_t tile;
+    bool have_tile;
+    uint32_t run;
+    int shift;
+} RleDecoder;
+
+static bool rle_decode(RleDecoder *decoder, const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (!decoder->have_tile) {
+            decoder->tile = data[i];
+            decoder->have_tile = true;
+            decoder->run = 0;
+            decoder->shift = 0;
+            continue;
+        }
+        //the fifth byte holds bits 28 to 31, anything above does not fit a run
+        if (decoder->shift == 28 && (data[i] & 0x70)) return false;
+        decoder->run |= (uint32_t) (data[i] & 0x7F) << decoder->shift;
+        if (data[i] & 0x80) {
+            if ((decoder->shift += 7) > 28) return false;
+            continue;
+        }
+        if (decoder->run == 0 || decoder->run > decoder->left) return false;
+        //the output starts zeroed, so only the runs of other tiles are written
+        decoder->left -= decoder->run;
+        while (decoder->run > 0) {
+            uint32_t n = decoder->width - decoder->x;
+            if (n > decoder->run) n = decoder->run;
+            if (decoder->tile != MAP_FREE)
+                memset(decoder->out, decoder->tile, n);
+            decoder->out += n;
+            decoder->x += n;
+            decoder->run -= n;
+            if (decoder->x == decoder->width) {
+                decoder->out += decoder->stride - decoder->width;
+                decoder->x = 0;
+            }
+        }
+        decoder->have_tile = false;
+    }
+    return true;
+}
 
+static void rle_init(RleDecoder *decoder, const Map *map) {
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->out = map->tiles;
+    decoder->left = (size_t) map->width * map->height;
+    decoder->width = map->width;
+    decoder->stride = map->stride;
+}
+
+static bool rle_done(const RleDecoder *decoder) {
+    return decoder->left == 0 && !decoder->have_tile;
+}
+
+#define MAP_IO_BLOCK_SIZE (64 * 1024)
+
+static bool read_map(char *path, MapHeader *header) {
     SDL_RWops *map_file = SDL_RWFromFile(path, "rb");
     if (map_file == NULL) return false;
 
-    //check the signature
-    {
-        char signature[sizeof CANTS_MAP_SIGNATURE / sizeof(char)] = {0};
-        if (SDL_RWread(map_file, &signature, sizeof(char), sizeof CANTS_MAP_SIGNATURE / sizeof(char) - 1) != sizeof CANTS_MAP_SIGNATURE / sizeof(char) - 1) {
-            fprintf(stderr, "Failed reading from file.\n");
-            return false;
+    uint8_t header_data[MAP_V2_HEADER_SIZE];
+    size_t needed;
+    size_t header_size = SDL_RWread(map_file, header_data, sizeof(uint8_t), MAP_V1_HEADER_SIZE);
+    size_t offset = parse_header(header_data, header_size, header, &needed);
+    if (offset == 0 && needed > header_size) {
+        //versioned header, read the rest of it
+        header_size += SDL_RWread(map_file, header_data + header_size, sizeof(uint8_t), needed - header_size);
+        offset = parse_header(header_data, header_size, header, &needed);
+    }
+    if (offset == 0) {
+        SDL_RWclose(map_file);
+        return false;
+    }
+    apply_header(header);
+
+    if (!map_alloc(&g_map, header->width, header->height)) {
+        SDL_RWclose(map_file);
+        return false;
+    }
+    bool read;
+    if (header->encoding == MAP_ENCODING_RLE) {
+        //decode block by block straight into the tiles
+        RleDecoder decoder;
+        rle_init(&decoder, &g_map);
+        uint8_t *block = malloc(MAP_IO_BLOCK_SIZE);
+        size_t data_left = header->data_size;
+        read = block != NULL;
+        while (read && data_left > 0) {
+            size_t n = SDL_RWread(map_file, block, sizeof(uint8_t), data_left < MAP_IO_BLOCK_SIZE ? data_left : MAP_IO_BLOCK_SIZE);
+            data_left -= n;
+            read = n > 0 && rle_decode(&decoder, block, n);
         }
-        if (strcmp(signature, CANTS_MAP_SIGNATURE) != 0) {
-            fprintf(stderr, "Given file is not a cants map.\n");
+        read = read && rle_done(&decoder);
+        free(block);
+    }
+    else {
+        //rows are apart in memory because of the border, read them one by one
+        read = true;
+        for (int i = 0; read && i < g_map.height; i++)
+            read = SDL_RWread(map_file, map_row(&g_map, i), sizeof(int8_t), g_map.width) == (size_t) g_map.width;
+    }
+    SDL_RWclose(map_file);
+    if (!read) {
+        fprintf(stderr, "Failed reading the tiles from file.\n");
+        destroy_map(&g_map);
+    }
+    return read;
+}
+
+bool load_map_mode(char *path, enum MAP_LOAD how) {
+    MapHeader header;
+    g_map.mapping = NULL;
+#if MMAP_MAPS
+    void *mapping;
+    size_t size;
+    if (how != MAP_LOAD_COPY && mmap_file(path, &mapping, &size)) {
+        size_t needed;
+        size_t offset = parse_header(mapping, size, &header, &needed);
+        if (offset == 0 || size - offset < header.data_size) {
+            if (offset != 0) fprintf(stderr, "Failed reading from file.\n");
+            munmap(mapping, size);
             return false;
         }
+        apply_header(&header);
+#ifdef POSIX_MADV_SEQUENTIAL
+        posix_madvise(mapping, size, POSIX_MADV_SEQUENTIAL);
+#endif
+        if (how == MAP_LOAD_READONLY && header.encoding == MAP_ENCODING_RAW) {
+            g_map.buffer = NULL;
+            g_map.mapping = mapping;
+            g_map.mapping_size = size;
+            g_map.tiles = (int8_t *) mapping + offset;
+            g_map.stride = g_map.width;
+        }
+        else {
+            //compressed tiles cannot be used in place and the game needs the border,
+            //so the tiles are decoded or copied from the mapping in one pass
+            const uint8_t *data = (uint8_t *) mapping + offset;
+            bool decoded = map_alloc(&g_map, header.width, header.height);
+            if (decoded && header.encoding == MAP_ENCODING_RLE) {
+                RleDecoder decoder;
+                rle_init(&decoder, &g_map);
+                decoded = rle_decode(&decoder, data, header.data_size) && rle_done(&decoder);
+            }
+            else if (decoded) {
+                for (int i = 0; i < g_map.height; i++)
+                    memcpy(map_row(&g_map, i), data + (size_t) i * g_map.width, g_map.width);
+            }
+            munmap(mapping, size);
+            if (!decoded) {
+                fprintf(stderr, "Failed reading the tiles from file.\n");
+                destroy_map(&g_map);
+                return false;
+            }
+        }
     }
+    else
+#endif
+    if (!read_map(path, &header)) return false;
 
-    //read width and height
-    if (SDL_RWread(map_file, &g_map.width, sizeof g_map.width, 1) == 0 ||
-    SDL_RWread(map_file, &g_map.height, sizeof g_map.height, 1) == 0) return false;
+    if (header.version >= 2 && map_checksum(&g_map) != header.checksum) {
+        fprintf(stderr, "Map checksum mismatch, the file is corrupted.\n");
+        destroy_map(&g_map);
+        return false;
+    }
+    //validation, the histogram also gives the tile totals
+    size_t counts[MAP_TOTAL];
+    if (map_histogram(&g_map, counts) > 0) {
+        fprintf(stderr, "Map contains invalid tiles.\n");
+        destroy_map(&g_map);
+        return false;
+    }
+    for (int type = 0; type < MAP_TOTAL; type++)
+        g_map.tile_counts[type] = counts[type];
+    if (how != MAP_LOAD_READONLY && !index_map(&g_map)) {
+        destroy_map(&g_map);
+        return false;
+    }
+    return true;
+}
 
-    if ((g_map.matrix = malloc(g_map.height * sizeof(int8_t *))) == NULL) return false;
-    for (int i = 0; i < g_map.height; i++) {
-        if ((g_map.matrix[i] = malloc(g_map.width * sizeof(int8_t))) == NULL) {
-            //if failed, free everything allocated
-            for (int j = 0; j < i; j++) {
-                free(g_map.matrix[j]);
-            }
-            free(g_map.matrix);
-            g_map.matrix = NULL;
-            return false;
-        }
+bool load_map(char *path) {
+    return load_map_mode(path, MAP_LOAD_COPY);
+}
+
+static void destroy_map_index(Map *map) {
+    free(map->chunk_counts);
+    map->chunk_counts = NULL;
+    free(map->free_tree);
+    map->free_tree = NULL;
+    free(map->planes);
+    map->planes = NULL;
+}
+
+void destroy_map(Map *map) {
+#if MMAP_MAPS
+    if (map->mapping != NULL) {
+        munmap(map->mapping, map->mapping_size);
+        map->mapping = NULL;
     }
-    for (int i = 0; i < g_map.height; i++) {
-        if (SDL_RWread(map_file, g_map.matrix[i], sizeof(int8_t), g_map.width) == 0) {
-            for (int j = 0; j < g_map.height; j++) {
-                free(g_map.matrix[j]);
-            }
-            free(g_map.matrix);
-            g_map.matrix = NULL;
-            return false;
+    else
+#endif
+    free(map->buffer);
+    map->buffer = NULL;
+    map->tiles = NULL;
+    destroy_map_index(map);
+}
+
+bool map_alloc(Map *map, int32_t width, int32_t height) {
+    int32_t stride = width + 2 * MAP_BORDER;
+    size_t rows = height + 2 * MAP_BORDER;
+    if ((map->buffer = calloc(rows * stride, sizeof(int8_t))) == NULL)
+        return false;
+    map->width = width;
+    map->height = height;
+    map->stride = stride;
+    map->mapping = NULL;
+    map->tiles = map->buffer + MAP_BORDER * stride + MAP_BORDER;
+    //the top and bottom rows are whole, the sides are the columns between them
+    memset(map->buffer, MAP_WALL, MAP_BORDER * stride);
+    memset(map->buffer + (rows - MAP_BORDER) * stride, MAP_WALL, MAP_BORDER * stride);
+    for (int i = 0; i < height; i++) {
+        memset(map_row(map, i) - MAP_BORDER, MAP_WALL, MAP_BORDER);
+        memset(map_row(map, i) + width, MAP_WALL, MAP_BORDER);
+    }
+    return true;
+}
+
+static inline uint16_t *chunk_counts_of(Map *map, int x, int y) {
+    return &map->chunk_counts[((y / MAP_CHUNK_SIZE) * map->chunks_w + x / MAP_CHUNK_SIZE) * MAP_TOTAL];
+}
+
+//the Fenwick tree entry of chunk c (1-based) holds the free tiles of the chunks c - lowbit(c) + 1 to c
+static void free_tree_add(Map *map, size_t chunk, int32_t delta) {
+    size_t chunks = (size_t) map->chunks_w * map->chunks_h;
+    for (size_t c = chunk + 1; c <= chunks; c += c & -c)
+        map->free_tree[c] += delta;
+}
+
+//free tiles in the chunks before the given one
+static int64_t free_tree_prefix(const Map *map, size_t chunk) {
+    int64_t sum = 0;
+    for (size_t c = chunk; c > 0; c -= c & -c)
+        sum += map->free_tree[c];
+    return sum;
+}
+
+//the chunk holding the n-th free tile in chunk order, n is made relative to the chunk
+static size_t free_tree_find(const Map *map, int64_t *n) {
+    size_t chunks = (size_t) map->chunks_w * map->chunks_h;
+    size_t step = 1, c = 0;
+    while (step * 2 <= chunks) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (c + step <= chunks && map->free_tree[c + step] <= *n) {
+            c += step;
+            *n -= map->free_tree[c];
         }
     }
+    return c;
+}
+
+static inline uint64_t *plane_word_of(Map *map, int type, int x, int y) {
+    return (uint64_t *) map_plane_row(map, type, y) + (x + MAP_BORDER) / 64;
+}
+
+static inline uint64_t plane_bit_of(int x) {
+    return (uint64_t) 1 << (x + MAP_BORDER) % 64;
+}
 
+//(re)build the chunk summaries, the free tiles tree and the bit planes from scratch,
+//needed after the tiles were changed in bulk (the tiles must be valid, see load_map_mode)
+bool index_map(Map *map) {
+    destroy_map_index(map);
+    map->chunks_w = (map->width + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    map->chunks_h = (map->height + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    map->plane_words = (map->width + 2 * MAP_BORDER + 63) / 64;
+    map->chunk_counts = calloc((size_t) map->chunks_w * map->chunks_h * MAP_TOTAL, sizeof(uint16_t));
+    map->free_tree = malloc(((size_t) map->chunks_w * map->chunks_h + 1) * sizeof(int32_t));
+    map->planes = calloc((size_t) MAP_PLANES * (map->height + 2 * MAP_BORDER) * map->plane_words, sizeof(uint64_t));
+    if (map->chunk_counts == NULL || map->free_tree == NULL || map->planes == NULL) {
+        destroy_map_index(map);
+        return false;
+    }
+    for (int i = 0; i < map->height; i++) {
+        int8_t *row = map_row(map, i);
+        for (int j = 0; j < map->width; j++) {
+            chunk_counts_of(map, j, i)[row[j]]++;
+            if (row[j] != MAP_FREE)
+                *plane_word_of(map, row[j], j, i) |= plane_bit_of(j);
+        }
+    }
+    //the border
+    for (int i = -MAP_BORDER; i < map->height + MAP_BORDER; i++)
+        for (int j = -MAP_BORDER; j < map->width + MAP_BORDER; j++)
+            if (i < 0 || j < 0 || i >= map->height || j >= map->width)
+                *plane_word_of(map, MAP_WALL, j, i) |= plane_bit_of(j);
+    for (int type = 0; type < MAP_TOTAL; type++)
+        map->tile_counts[type] = 0;
+    size_t chunks = (size_t) map->chunks_w * map->chunks_h;
+    for (size_t c = 0; c < chunks; c++)
+        for (int type = 0; type < MAP_TOTAL; type++)
+            map->tile_counts[type] += map->chunk_counts[c * MAP_TOTAL + type];
+    //the tree is built bottom up, every entry adds itself to its parent
+    map->free_tree[0] = 0;
+    for (size_t c = 1; c <= chunks; c++)
+        map->free_tree[c] = map->chunk_counts[(c - 1) * MAP_TOTAL + MAP_FREE];
+    for (size_t c = 1; c <= chunks; c++)
+        if (c + (c & -c) <= chunks)
+            map->free_tree[c + (c & -c)] += map->free_tree[c];
     return true;
 }
 
-Point find_random_free_spot_on_a_map(void) {
-    short x, y;
-    while (g_map.matrix[y = rand() % g_map.height][x = rand() % g_map.width] != MAP_FREE);
-    Point point = {x, y};
+void map_set(Map *map, int x, int y, int8_t tile) {
+    int8_t *cell = map_row(map, y) + x;
+    if (map->chunk_counts != NULL && *cell != tile) {
+        uint16_t *counts = chunk_counts_of(map, x, y);
+        counts[*cell]--;
+        counts[tile]++;
+        map->tile_counts[(int) *cell]--;
+        map->tile_counts[tile]++;
+        size_t chunk = (size_t) (y / MAP_CHUNK_SIZE) * map->chunks_w + x / MAP_CHUNK_SIZE;
+        if (*cell == MAP_FREE)
+            free_tree_add(map, chunk, -1);
+        else
+            *plane_word_of(map, *cell, x, y) &= ~plane_bit_of(x);
+        if (tile == MAP_FREE)
+            free_tree_add(map, chunk, 1);
+        else
+            *plane_word_of(map, tile, x, y) |= plane_bit_of(x);
+    }
+    *cell = tile;
+}
+
+int map_plane_next(const Map *map, int type, int y, int x, int x_end) {
+    if (x >= x_end) return -1;
+    const uint64_t *row = map_plane_row(map, type, y);
+    int bit = x + MAP_BORDER, end = x_end + MAP_BORDER;
+    int word = bit / 64;
+    //bits before x are masked off the first word, then whole words of nothing are skipped
+    uint64_t bits = row[word] & (~(uint64_t) 0 << bit % 64);
+    while (bits == 0) {
+        if (++word * 64 >= end) return -1;
+        bits = row[word];
+    }
+    bit = word * 64 + __builtin_ctzll(bits);
+    return bit < end ? bit - MAP_BORDER : -1;
+}
+
+//number of tiles in a chunk, chunks on the right and bottom edges may be cut
+static int chunk_tiles(const Map *map, int cx, int cy) {
+    int w = map->width - cx * MAP_CHUNK_SIZE, h = map->height - cy * MAP_CHUNK_SIZE;
+    return (w < MAP_CHUNK_SIZE ? w : MAP_CHUNK_SIZE) * (h < MAP_CHUNK_SIZE ? h : MAP_CHUNK_SIZE);
+}
+
+int map_chunk_uniform(const Map *map, int cx, int cy) {
+    const uint16_t *counts = map_chunk_counts(map, cx, cy);
+    int tiles = chunk_tiles(map, cx, cy);
+    for (int type = 0; type < MAP_TOTAL; type++)
+        if (counts[type] == tiles) return type;
+    return -1;
+}
+
+static inline int clamp(int v, int lo, int hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+//bit j of the mask is set if tile (x + j, y) is free, for the w <= 32 tiles from x on
+//a tile is free if it is in none of the planes, the bits are read a word or two at a time like map_neighbours does
+static uint32_t free_row_mask(const Map *map, int x, int y, int w) {
+    int bit = x + MAP_BORDER;
+    int word = bit / 64, shift = bit % 64;
+    uint64_t taken = 0;
+    for (int type = 1; type < MAP_TOTAL; type++) {
+        const uint64_t *row = map_plane_row(map, type, y);
+        uint64_t bits = row[word] >> shift;
+        if (shift > 64 - w && word + 1 < map->plane_words) bits |= row[word + 1] << (64 - shift);
+        taken |= bits;
+    }
+    return ~(uint32_t) taken & (uint32_t) (((uint64_t) 1 << w) - 1);
+}
+
+//count free tiles of a chunk that lie outside the rectangle, or return the n-th of them
+//in *found if found is not NULL; a row of the chunk is a mask of its free tiles, so this takes
+//MAP_CHUNK_SIZE popcounts and picking the tile in its row at most MAP_CHUNK_SIZE more steps
+static int32_t scan_chunk_outside(int cx, int cy, int x0, int y0, int x1, int y1, int32_t n, Point *found) {
+    int32_t count = 0;
+    int start_x = cx * MAP_CHUNK_SIZE;
+    int end_y = clamp((cy + 1) * MAP_CHUNK_SIZE, 0, g_map.height);
+    int w = clamp(g_map.width - start_x, 0, MAP_CHUNK_SIZE);
+    //columns of the chunk inside the rectangle
+    int in_x0 = clamp(x0 - start_x, 0, w), in_x1 = clamp(x1 - start_x, 0, w);
+    uint32_t inside = (uint32_t) (((uint64_t) 1 << in_x1) - ((uint64_t) 1 << in_x0));
+    for (int i = cy * MAP_CHUNK_SIZE; i < end_y; i++) {
+        uint32_t mask = free_row_mask(&g_map, start_x, i, w);
+        if (y0 <= i && i < y1) mask &= ~inside;
+        int32_t row_count = __builtin_popcount(mask);
+        if (found != NULL && n < count + row_count) {
+            for (int32_t k = count; k < n; k++)
+                mask &= mask - 1;
+            found->x = start_x + __builtin_ctz(mask);
+            found->y = i;
+            return n;
+        }
+        count += row_count;
+    }
+    return count;
+}
+
+//a chunk is picked from the tree by its share of the free tiles, then the tile is counted out of the chunk's
+//free masks: O(log chunks) in all, however the map looks and without touching the tiles
+Point find_random_free_spot_on_a_map(Rng *rng) {
+    Point point = {-1, -1};
+    if (g_map.tile_counts[MAP_FREE] == 0) return point;
+    int64_t n = rng_below(rng, g_map.tile_counts[MAP_FREE]);
+    size_t chunk = free_tree_find(&g_map, &n);
+    scan_chunk_outside(chunk % g_map.chunks_w, chunk / g_map.chunks_w, 0, 0, 0, 0, n, &point);
     return point;
 }
 
-//not the most efficient way, but allows to check if there are free points at all
-//TODO: index all free spaces and make this function extra fast and safe or find a better way to do this
-Point find_random_free_spot_on_a_map_safe(void) {
-    Point free_points[g_map.height * g_map.width];
-    int sp = 0;
-    Point point;
+//free tiles of a chunk outside the rectangle: whole chunks come from the chunk summaries,
+//only the chunks crossed by the rectangle border are scanned
+static int32_t chunk_free_outside(int cx, int cy, int x0, int y0, int x1, int y1) {
+    int chunk_x0 = cx * MAP_CHUNK_SIZE, chunk_y0 = cy * MAP_CHUNK_SIZE;
+    int chunk_x1 = chunk_x0 + MAP_CHUNK_SIZE, chunk_y1 = chunk_y0 + MAP_CHUNK_SIZE;
+    if (x1 <= chunk_x0 || x0 >= chunk_x1 || y1 <= chunk_y0 || y0 >= chunk_y1)
+        return map_chunk_count(&g_map, cx, cy, MAP_FREE);
+    if (x0 <= chunk_x0 && chunk_x1 <= x1 && y0 <= chunk_y0 && chunk_y1 <= y1)
+        return 0;
+    return scan_chunk_outside(cx, cy, x0, y0, x1, y1, 0, NULL);
+}
+
+//the free tiles outside the rectangle are walked as pieces in chunk order: runs of chunks the rectangle does
+//not touch, which are summed from the tree, and the chunks it crosses, which are counted one by one
+//(chunks fully inside it have none); the walk either counts them all or stops at the n-th one
+typedef struct {
+    int x0, y0, x1, y1;
+    int64_t total;
+    bool picking;
+    int64_t n;
+    Point found;
+} OutsideWalk;
+
+static bool walk_chunks(OutsideWalk *walk, size_t from, size_t to) {
+    int64_t count = free_tree_prefix(&g_map, to) - free_tree_prefix(&g_map, from);
+    if (walk->picking && walk->n < walk->total + count) {
+        int64_t n = free_tree_prefix(&g_map, from) + walk->n - walk->total;
+        size_t chunk = free_tree_find(&g_map, &n);
+        scan_chunk_outside(chunk % g_map.chunks_w, chunk / g_map.chunks_w, walk->x0, walk->y0, walk->x1, walk->y1, n, &walk->found);
+        return true;
+    }
+    walk->total += count;
+    return false;
+}
+
+static bool walk_crossed_chunk(OutsideWalk *walk, int cx, int cy) {
+    int32_t count = chunk_free_outside(cx, cy, walk->x0, walk->y0, walk->x1, walk->y1);
+    if (walk->picking && walk->n < walk->total + count) {
+        scan_chunk_outside(cx, cy, walk->x0, walk->y0, walk->x1, walk->y1, walk->n - walk->total, &walk->found);
+        return true;
+    }
+    walk->total += count;
+    return false;
+}
+
+static bool walk_outside(OutsideWalk *walk) {
+    int cx0 = walk->x0 / MAP_CHUNK_SIZE, cx1 = (walk->x1 - 1) / MAP_CHUNK_SIZE;
+    int cy0 = walk->y0 / MAP_CHUNK_SIZE, cy1 = (walk->y1 - 1) / MAP_CHUNK_SIZE;
+    size_t next = 0;
+    for (int cy = cy0; cy <= cy1; cy++) {
+        size_t row = (size_t) cy * g_map.chunks_w;
+        if (walk_chunks(walk, next, row + cx0)) return true;
+        //chunks between the first and the last one of an inner row lie inside the rectangle
+        for (int cx = cx0; cx <= cx1; cx++) {
+            if (cy > cy0 && cy < cy1 && cx > cx0 && cx < cx1) cx = cx1;
+            if (walk_crossed_chunk(walk, cx, cy)) return true;
+        }
+        next = row + cx1 + 1;
+    }
+    return walk_chunks(walk, next, (size_t) g_map.chunks_w * g_map.chunks_h);
+}
+
+//pick a chunk weighted by its free tiles outside the rectangle, then a tile inside it
+//the cost depends on the rectangle perimeter in chunks and the log of the number of chunks, not on the areas
+Point find_random_free_spot_outside(Rng *rng, int x0, int y0, int x1, int y1) {
+    x0 = clamp(x0, 0, g_map.width);
+    x1 = clamp(x1, 0, g_map.width);
+    y0 = clamp(y0, 0, g_map.height);
+    y1 = clamp(y1, 0, g_map.height);
+    if (x0 >= x1 || y0 >= y1) return find_random_free_spot_on_a_map(rng);
+
+    OutsideWalk walk = {x0, y0, x1, y1, 0, false, 0, {-1, -1}};
+    walk_outside(&walk);
+    if (walk.total == 0) return walk.found;
+    walk.n = rng_below(rng, walk.total);
+    walk.total = 0;
+    walk.picking = true;
+    walk_outside(&walk);
+    return walk.found;
+}
+
+//buffered writer used to stream the tiles into a file
+typedef struct {
+    SDL_RWops *file;
+    uint8_t *block;
+    size_t used;
+    uint32_t written; //bytes passed to the writer so far
+    bool ok;
+} MapWriter;
+
+static void writer_flush(MapWriter *writer) {
+    if (writer->ok && writer->used > 0)
+        writer->ok = SDL_RWwrite(writer->file, writer->block, sizeof(uint8_t), writer->used) == writer->used;
+    writer->used = 0;
+}
+
+//after a failure (or without a block) nothing more is written, save_map reports it at the end
+static void writer_put(MapWriter *writer, const void *data, size_t size) {
+    writer->written += size;
+    if (!writer->ok) return;
+    while (size > 0) {
+        size_t n = MAP_IO_BLOCK_SIZE - writer->used;
+        if (n > size) n = size;
+        memcpy(writer->block + writer->used, data, n);
+        writer->used += n;
+        data = (const uint8_t *) data + n;
+        size -= n;
+        if (writer->used == MAP_IO_BLOCK_SIZE) writer_flush(writer);
+    }
+}
+
+static void rle_put_run(MapWriter *writer, int8_t tile, uint32_t run) {
+    uint8_t bytes[6];
+    int n = 0;
+    bytes[n++] = tile;
+    do {
+        bytes[n] = run & 0x7F;
+        run >>= 7;
+        if (run > 0) bytes[n] |= 0x80;
+        n++;
+    } while (run > 0);
+    writer_put(writer, bytes, n);
+}
+
+//runs go on across row ends, so a map of long runs takes a few bytes per run
+static void rle_encode(MapWriter *writer) {
+    int8_t tile = map_get(&g_map, 0, 0);
+    uint32_t run = 0;
     for (int i = 0; i < g_map.height; i++) {
+        const int8_t *row = map_row(&g_map, i);
         for (int j = 0; j < g_map.width; j++) {
-            if (g_map.matrix[i][j] == MAP_FREE) {
-                point.y = i;
-                point.x = j;
-                free_points[sp++] = point;
+            if (row[j] != tile) {
+                rle_put_run(writer, tile, run);
+                tile = row[j];
+                run = 0;
             }
+            run++;
         }
     }
-    assert(sp > 0);
-    return free_points[rand() % sp];
+    rle_put_run(writer, tile, run);
+}
+
+//always writes the latest format version
+bool save_map(char *path, enum MAP_ENCODING encoding) {
+    SDL_RWops *map_file = SDL_RWFromFile(path, "wb");
+    if (map_file == NULL) {
+        fprintf(stderr, "Failed to open %s for writing: %s\n", path, SDL_GetError());
+        return false;
+    }
+
+    //the tiles are streamed after a placeholder header, which is rewritten once the size is known
+    uint8_t header[MAP_V2_HEADER_SIZE] = {0};
+    MapWriter writer = {map_file, malloc(MAP_IO_BLOCK_SIZE), 0, 0, true};
+    writer.ok = writer.block != NULL && SDL_RWwrite(map_file, header, sizeof(uint8_t), MAP_V2_HEADER_SIZE) == MAP_V2_HEADER_SIZE;
+    if (encoding == MAP_ENCODING_RLE)
+        rle_encode(&writer);
+    else
+        for (int i = 0; i < g_map.height; i++)
+            writer_put(&writer, map_row(&g_map, i), g_map.width);
+    writer_flush(&writer);
+    free(writer.block);
+
+    memcpy(header, CANTS_MAP_SIGNATURE, SIGNATURE_LEN);
+    header[SIGNATURE_LEN + 1] = MAP_VERSION;
+    header[SIGNATURE_LEN + 2] = encoding;
+    uint8_t *fields = header + SIGNATURE_LEN + 4;
+    write_le32(fields, g_map.width);
+    write_le32(fields + 4, g_map.height);
+    write_le32(fields + 8, g_map.anthill_x);
+    write_le32(fields + 12, g_map.anthill_y);
+    write_le32(fields + 16, map_checksum(&g_map));
+    write_le32(fields + 20, writer.written);
+
+    bool written = writer.ok && SDL_RWseek(map_file, 0, RW_SEEK_SET) == 0 &&
+        SDL_RWwrite(map_file, header, sizeof(uint8_t), MAP_V2_HEADER_SIZE) == MAP_V2_HEADER_SIZE;
+    if (SDL_RWclose(map_file) != 0) written = false;
+    if (!written) fprintf(stderr, "Failed writing the map to %s\n", path);
+    return written;
 }
@@ -1,29 +1,142 @@
 #ifndef MAP_H
 #define MAP_H 1
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "cants_config.h"
+#include "rng.h"
 
-typedef struct {
-    int8_t **matrix;
-    uint8_t width;
-    uint8_t height;
-} Map;
+enum MAP { MAP_FREE, 
+           MAP_WALL, 
+           MAP_ENCLOSED, 
+           MAP_FOOD, 
+           MAP_ANTHILL, 
+           MAP_TOTAL};
 
 typedef struct {
-    short x;
-    short y;
+    int32_t x;
+    int32_t y;
 } Point;
 
+//the map is split into square chunks of this many tiles for spatial queries
+#define MAP_CHUNK_SIZE 16
+//width of the wall ring around the map in memory
+#define MAP_BORDER 1
+//bit planes, one for every tile type but MAP_FREE
+#define MAP_PLANES (MAP_TOTAL - 1)
+
+//tiles are stored row-major in a single allocation: tile (x, y) is tiles[y * stride + x]
+//maps that own their tiles are surrounded by a ring of MAP_BORDER wall tiles, so the 8 neighbours of any
+//tile on the map can be read without bounds checks (tiles points at (0, 0) inside the buffer),
+//the border is never saved, counted or indexed
+//the bit planes mirror the tiles with a bitset per type (but MAP_FREE, which is none of them), so
+//neighbourhood and row queries look at up to 64 tiles per word; they include the border and, like
+//the chunk index below, are only built for maps that are played or edited
+//chunk_counts summarises every chunk (row-major, chunks_w * chunks_h) with a count per tile type and
+//free_tree is a Fenwick tree over their free tiles, so a chunk can be picked by its share of them in O(log chunks)
+//and a random free tile is found in it; nothing is kept per tile besides the tiles and the planes
+typedef struct {
+    int8_t *tiles;
+    int8_t *buffer; //allocation holding the tiles and the border, NULL if the tiles are mapped from a file
+    int32_t width;
+    int32_t height;
+    int32_t stride; //distance between rows, width + 2 * MAP_BORDER (or width without the border)
+    int32_t anthill_x; //top left tile of the anthill as stored in the file, -1 if unknown
+    int32_t anthill_y;
+    int32_t tile_counts[MAP_TOTAL]; //tiles of every type on the whole map
+    uint64_t *planes; //MAP_PLANES planes of (height + 2 * MAP_BORDER) rows
+    int32_t plane_words; //words per plane row
+    uint16_t *chunk_counts;
+    int32_t *free_tree; //chunks_w * chunks_h + 1 entries, the first one is unused
+    int chunks_w;
+    int chunks_h;
+    void *mapping; //file mapping the tiles point into, NULL if they are on the heap
+    size_t mapping_size;
+} Map;
+
+//how the tiles are stored in a map file
+enum MAP_ENCODING {
+    MAP_ENCODING_RAW, //a byte per tile
+    MAP_ENCODING_RLE, //runs of equal tiles
+};
+
+//how load_map_mode brings the tiles into memory
+enum MAP_LOAD {
+    MAP_LOAD_COPY,        //read into a heap buffer, the map can be edited and resized
+    MAP_LOAD_MAPPED_COPY, //same, but decoded or copied out of a shared read-only file mapping, which is unmapped
+                          //right after, instead of through read buffers
+    MAP_LOAD_READONLY,    //tiles used in place from a shared read-only file mapping, without the border
+                          //and the map index, for tools
+};
+
 extern Map g_map;
 bool load_map(char *path);
-Point find_random_free_spot_on_a_map(void);
+bool load_map_mode(char *path, enum MAP_LOAD how);
+bool save_map(char *path, enum MAP_ENCODING encoding);
+uint32_t map_checksum(const Map *map);
+void destroy_map(Map *map);
+//allocate free tiles surrounded by the border, the previous tiles are not freed
+bool map_alloc(Map *map, int32_t width, int32_t height);
+bool index_map(Map *map);
+//returns {-1, -1} if there are no free tiles on the map
+Point find_random_free_spot_on_a_map(Rng *rng);
+//same, but never returns a tile inside the [x0, x1) x [y0, y1) rectangle (in tiles)
+Point find_random_free_spot_outside(Rng *rng, int x0, int y0, int x1, int y1);
+
+//tile accessors, all map code goes through these instead of indexing tiles directly
+static inline int8_t *map_row(const Map *map, int y) {
+    return map->tiles + (ptrdiff_t) y * map->stride;
+}
+
+//reads are safe from -MAP_BORDER to width - 1 + MAP_BORDER (height likewise) on bordered maps
+static inline int8_t map_get(const Map *map, int x, int y) {
+    return map->tiles[(ptrdiff_t) y * map->stride + x];
+}
+
+//map_set keeps the chunk summaries, the free tiles tree and the bit planes up to date, so writes must not bypass it
+void map_set(Map *map, int x, int y, int8_t tile);
+
+//bits of row y in the plane of the given type, bit x + MAP_BORDER is tile (x, y)
+static inline const uint64_t *map_plane_row(const Map *map, int type, int y) {
+    return map->planes + ((size_t) (type - 1) * (map->height + 2 * MAP_BORDER) + y + MAP_BORDER) * map->plane_words;
+}
+
+//the bit of the (dx, dy) neighbour in a map_neighbours mask
+#define MAP_NEIGHBOUR_BIT(dx, dy) (1u << (((dy) + 1) * 3 + (dx) + 1))
+
+//which tiles of the 3x3 block around (x, y) are of the given type, (x, y) must be on the map
+static inline unsigned map_neighbours(const Map *map, int type, int x, int y) {
+    unsigned mask = 0;
+    int bit = x - 1 + MAP_BORDER;
+    int word = bit / 64, shift = bit % 64;
+    for (int dy = -1; dy <= 1; dy++) {
+        const uint64_t *row = map_plane_row(map, type, y + dy);
+        uint64_t bits = row[word] >> shift;
+        //the block may straddle two words, the next one always exists because of the border
+        if (shift > 61) bits |= row[word + 1] << (64 - shift);
+        mask |= (bits & 7) << ((dy + 1) * 3);
+    }
+    return mask;
+}
+
+//first tile of the given type in row y from x up to x_end - 1, -1 if there is none
+int map_plane_next(const Map *map, int type, int y, int x, int x_end);
+
+//chunk summaries answer whole chunk questions (e.g. is there any food) without touching the tiles
+static inline const uint16_t *map_chunk_counts(const Map *map, int cx, int cy) {
+    return &map->chunk_counts[((size_t) cy * map->chunks_w + cx) * MAP_TOTAL];
+}
+
+static inline int map_chunk_count(const Map *map, int cx, int cy, int type) {
+    return map_chunk_counts(map, cx, cy)[type];
+}
+
+//the type of all tiles in the chunk, -1 if they differ
+int map_chunk_uniform(const Map *map, int cx, int cy);
 
-enum MAP { MAP_FREE, 
-           MAP_WALL, 
-           MAP_ENCLOSED, 
-           MAP_FOOD, 
-           MAP_ANTHILL, 
-           MAP_TOTAL};
 #define CANTS_MAP_SIGNATURE "CANTS_MAP"
+#define MAP_VERSION 2
+//tile indices must fit into int32_t
+#define MAP_MAX_SIDE 65535
+#define MAP_MAX_TILES (1u << 30)
 #endif //MAP_H
@@ -0,0 +1,53 @@
+#ifndef RNG_H
+#define RNG_H 1
+#include <stdint.h>
+
+/* Random numbers.
+ * Small xorshift generators with their state passed explicitly instead of the global rand().
+ * Every subsystem draws from its own stream derived from one seed, so a run is reproduced from its seed,
+ * what one subsystem draws does not shift the others and no state is shared between threads.
+ */
+
+typedef struct {
+    uint64_t state;
+} Rng;
+
+//splitmix64 of the seed and the stream number, so nearby seeds and streams still start far apart
+static inline Rng rng_stream(uint64_t seed, uint64_t stream) {
+    uint64_t z = seed + (stream + 1) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    //xorshift never leaves 0
+    Rng rng = {z != 0 ? z : 1};
+    return rng;
+}
+
+//xorshift64*, the upper bits are the good ones
+static inline uint32_t rng_next(Rng *rng) {
+    uint64_t x = rng->state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    rng->state = x;
+    return (x * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+//uniform in [0, n) without a division
+static inline uint32_t rng_below(Rng *rng, uint32_t n) {
+    return ((uint64_t) rng_next(rng) * n) >> 32;
+}
+
+//uniform in [0, 1)
+static inline float rng_float(Rng *rng) {
+    return (rng_next(rng) >> 8) * (1.0f / (1 << 24));
+}
+
+//xorshift32 step for state kept in a single word, such as an npc column (x must not be 0)
+static inline uint32_t xorshift32(uint32_t x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+#endif //RNG_H
@@ -0,0 +1,216 @@
+#include <stdbool.h>
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#else
+#define SCAN_X86 0
+#endif
+
+//byte counters overflow after 255 vectors, so the sums are widened at least that often
+#define SCAN_MAX_BLOCKS 255
+
+size_t scan_histogram_scalar(const int8_t *tiles, size_t n, size_t counts[MAP_TOTAL]) {
+    size_t invalid = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (tiles[i] >= 0 && tiles[i] < MAP_TOTAL)
+            counts[tiles[i]]++;
+        else
+            invalid++;
+    }
+    return invalid;
+}
+
+ptrdiff_t scan_find_first_scalar(const int8_t *tiles, size_t n, int8_t type) {
+    for (size_t i = 0; i < n; i++)
+        if (tiles[i] == type) return i;
+    return -1;
+}
+
+size_t scan_count_scalar(const int8_t *tiles, size_t n, int8_t type) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+        count += tiles[i] == type;
+    return count;
+}
+
+#if SCAN_X86
+//the vector kernels only count valid types and leave the tail to the scalar versions,
+//invalid tiles are whatever is left uncounted
+
+static size_t histogram_sse2(const int8_t *tiles, size_t n, size_t counts[MAP_TOTAL]) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    while (n - i >= 16) {
+        size_t blocks = (n - i) / 16;
+        if (blocks > SCAN_MAX_BLOCKS) blocks = SCAN_MAX_BLOCKS;
+        __m128i acc[MAP_TOTAL];
+        for (int type = 0; type < MAP_TOTAL; type++) acc[type] = zero;
+        for (size_t b = 0; b < blocks; b++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (tiles + i));
+            //a match is -1, so subtracting it counts up
+            for (int type = 0; type < MAP_TOTAL; type++)
+                acc[type] = _mm_sub_epi8(acc[type], _mm_cmpeq_epi8(v, _mm_set1_epi8(type)));
+        }
+        for (int type = 0; type < MAP_TOTAL; type++) {
+            __m128i sums = _mm_sad_epu8(acc[type], zero);
+            counts[type] += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+        }
+    }
+    return i;
+}
+
+static ptrdiff_t find_first_sse2(const int8_t *tiles, size_t n, int8_t type) {
+    const __m128i needle = _mm_set1_epi8(type);
+    size_t i = 0;
+    for (; n - i >= 16; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (tiles + i)), needle));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    ptrdiff_t tail = scan_find_first_scalar(tiles + i, n - i, type);
+    return tail == -1 ? -1 : (ptrdiff_t) i + tail;
+}
+
+static size_t count_sse2(const int8_t *tiles, size_t n, int8_t type, size_t *count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i needle = _mm_set1_epi8(type);
+    size_t i = 0;
+    while (n - i >= 16) {
+        size_t blocks = (n - i) / 16;
+        if (blocks > SCAN_MAX_BLOCKS) blocks = SCAN_MAX_BLOCKS;
+        __m128i acc = zero;
+        for (size_t b = 0; b < blocks; b++, i += 16)
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (tiles + i)), needle));
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        *count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t sum_bytes_avx2(__m256i acc) {
+    __m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    return _mm_cvtsi128_si32(half) + _mm_extract_epi16(half, 4);
+}
+
+__attribute__((target("avx2")))
+static size_t histogram_avx2(const int8_t *tiles, size_t n, size_t counts[MAP_TOTAL]) {
+    size_t i = 0;
+    while (n - i >= 32) {
+        size_t blocks = (n - i) / 32;
+        if (blocks > SCAN_MAX_BLOCKS) blocks = SCAN_MAX_BLOCKS;
+        __m256i acc[MAP_TOTAL];
+        for (int type = 0; type < MAP_TOTAL; type++) acc[type] = _mm256_setzero_si256();
+        for (size_t b = 0; b < blocks; b++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (tiles + i));
+            for (int type = 0; type < MAP_TOTAL; type++)
+                acc[type] = _mm256_sub_epi8(acc[type], _mm256_cmpeq_epi8(v, _mm256_set1_epi8(type)));
+        }
+        for (int type = 0; type < MAP_TOTAL; type++)
+            counts[type] += sum_bytes_avx2(acc[type]);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static ptrdiff_t find_first_avx2(const int8_t *tiles, size_t n, int8_t type) {
+    const __m256i needle = _mm256_set1_epi8(type);
+    size_t i = 0;
+    for (; n - i >= 32; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (tiles + i)), needle));
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    ptrdiff_t tail = find_first_sse2(tiles + i, n - i, type);
+    return tail == -1 ? -1 : (ptrdiff_t) i + tail;
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(const int8_t *tiles, size_t n, int8_t type, size_t *count) {
+    const __m256i needle = _mm256_set1_epi8(type);
+    size_t i = 0;
+    while (n - i >= 32) {
+        size_t blocks = (n - i) / 32;
+        if (blocks > SCAN_MAX_BLOCKS) blocks = SCAN_MAX_BLOCKS;
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t b = 0; b < blocks; b++, i += 32)
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (tiles + i)), needle));
+        *count += sum_bytes_avx2(acc);
+    }
+    return i;
+}
+
+static bool has_avx2(void) {
+    static int avx2 = -1;
+    if (avx2 == -1) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+    return avx2;
+}
+#endif
+
+size_t scan_histogram(const int8_t *tiles, size_t n, size_t counts[MAP_TOTAL]) {
+#if SCAN_X86
+    size_t before = 0, after = 0;
+    for (int type = 0; type < MAP_TOTAL; type++) before += counts[type];
+    size_t done = has_avx2() ? histogram_avx2(tiles, n, counts) : histogram_sse2(tiles, n, counts);
+    scan_histogram_scalar(tiles + done, n - done, counts);
+    for (int type = 0; type < MAP_TOTAL; type++) after += counts[type];
+    return n - (after - before);
+#else
+    return scan_histogram_scalar(tiles, n, counts);
+#endif
+}
+
+ptrdiff_t scan_find_first(const int8_t *tiles, size_t n, int8_t type) {
+#if SCAN_X86
+    return has_avx2() ? find_first_avx2(tiles, n, type) : find_first_sse2(tiles, n, type);
+#else
+    return scan_find_first_scalar(tiles, n, type);
+#endif
+}
+
+size_t scan_count(const int8_t *tiles, size_t n, int8_t type) {
+#if SCAN_X86
+    size_t count = 0;
+    size_t done = has_avx2() ? count_avx2(tiles, n, type, &count) : count_sse2(tiles, n, type, &count);
+    return count + scan_count_scalar(tiles + done, n - done, type);
+#else
+    return scan_count_scalar(tiles, n, type);
+#endif
+}
+
+size_t map_histogram(const Map *map, size_t counts[MAP_TOTAL]) {
+    size_t invalid = 0;
+    for (int type = 0; type < MAP_TOTAL; type++) counts[type] = 0;
+    for (int i = 0; i < map->height; i++)
+        invalid += scan_histogram(map_row(map, i), map->width, counts);
+    return invalid;
+}
+
+Point map_find_first(const Map *map, int8_t type) {
+    Point point = {-1, -1};
+    for (int i = 0; i < map->height; i++) {
+        ptrdiff_t j = scan_find_first(map_row(map, i), map->width, type);
+        if (j != -1) {
+            point.x = j;
+            point.y = i;
+            break;
+        }
+    }
+    return point;
+}
+
+size_t map_count_in_rect(const Map *map, int x, int y, int w, int h, int8_t type) {
+    int x1 = x + w, y1 = y + h;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x1 > map->width) x1 = map->width;
+    if (y1 > map->height) y1 = map->height;
+    size_t count = 0;
+    for (int i = y; i < y1 && x < x1; i++)
+        count += scan_count(map_row(map, i) + x, x1 - x, type);
+    return count;
+}
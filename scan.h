@@ -0,0 +1,27 @@
+#ifndef SCAN_H
+#define SCAN_H 1
+#include <stddef.h>
+#include <stdint.h>
+#include "map.h"
+
+/* Tile scan kernels.
+ * Vectorised with SSE2 or AVX2 (chosen at runtime) on x86, plain loops elsewhere.
+ */
+
+//add the number of tiles of every type to counts, returns the number of tiles that are not a valid type
+size_t scan_histogram(const int8_t *tiles, size_t n, size_t counts[MAP_TOTAL]);
+//index of the first tile of the given type, -1 if there is none
+ptrdiff_t scan_find_first(const int8_t *tiles, size_t n, int8_t type);
+//number of tiles of the given type
+size_t scan_count(const int8_t *tiles, size_t n, int8_t type);
+
+//the same over a whole map or a rectangle of it (clipped to the map)
+size_t map_histogram(const Map *map, size_t counts[MAP_TOTAL]);
+Point map_find_first(const Map *map, int8_t type);
+size_t map_count_in_rect(const Map *map, int x, int y, int w, int h, int8_t type);
+
+//plain loop versions, used as the fallback and as the benchmark baseline
+size_t scan_histogram_scalar(const int8_t *tiles, size_t n, size_t counts[MAP_TOTAL]);
+ptrdiff_t scan_find_first_scalar(const int8_t *tiles, size_t n, int8_t type);
+size_t scan_count_scalar(const int8_t *tiles, size_t n, int8_t type);
+#endif //SCAN_H